@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# bench-cgi.sh - Compares tiny's three ways of running cgi-bin/adder: a
+#     spawn per request (-w 0), the persistent worker pool (-w N) and the
+#     in-process plugin adder.so (-p). Every request opens a new
+#     connection, as CGI responses are delimited by closing.
+#
+#     usage: ./bench-cgi.sh
+#     env:   BENCH_SECONDS (default 5), BENCH_CONNS (default 8),
+#            BENCH_WORKERS (default 4)
+#
+
+SECONDS_PER_RUN=${BENCH_SECONDS:-5}
+CONNS=${BENCH_CONNS:-8}
+WORKERS=${BENCH_WORKERS:-4}
+
+function cleanup {
+    kill ${tiny_pid} 2> /dev/null
+    wait 2> /dev/null
+}
+trap cleanup EXIT
+
+for prog in ./loadgen ./tiny/tiny ./tiny/cgi-bin/adder ./tiny/cgi-bin/adder.so
+do
+    if [ ! -x ${prog} ]; then
+        echo "Error: ${prog} not found. Run make bench-cgi."
+        exit 1
+    fi
+done
+
+for mode in spawn pool plugin
+do
+    case ${mode} in
+        spawn)  flags="-w 0"; echo "== spawn per request" ;;
+        pool)   flags="-w ${WORKERS} -W /cgi-bin/adder"; echo "== ${WORKERS} persistent workers" ;;
+        plugin) flags="-p /cgi-bin/adder=./cgi-bin/adder.so"; echo "== in-process plugin" ;;
+    esac
+    tiny_port=`./free-port.sh`
+    (cd ./tiny; exec ./tiny -b -t ${CONNS} ${flags} ${tiny_port} > /dev/null 2>&1) &
+    tiny_pid=$!
+    sleep 0.5
+    ./loadgen -c ${CONNS} -d ${SECONDS_PER_RUN} -N 1 "http://localhost:${tiny_port}/cgi-bin/adder?%d&2"
+    echo ""
+    kill ${tiny_pid}
+    wait ${tiny_pid} 2> /dev/null
+done
+exit 0
@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# bench-static.sh - Compares tiny's two static file paths, sendfile (the
+#     default) and mmap + write (-M), by fetching small files and the
+#     large video.mp4 straight from tiny over kept-alive connections.
+#
+#     usage: ./bench-static.sh
+#     env:   BENCH_SECONDS (default 5), BENCH_CONNS (default 8)
+#
+
+SECONDS_PER_RUN=${BENCH_SECONDS:-5}
+CONNS=${BENCH_CONNS:-8}
+FILES="home.html godzilla.jpg video.mp4"
+
+function cleanup {
+    kill ${tiny_pid} 2> /dev/null
+    wait 2> /dev/null
+}
+trap cleanup EXIT
+
+for prog in ./loadgen ./tiny/tiny
+do
+    if [ ! -x ${prog} ]; then
+        echo "Error: ${prog} not found. Run make bench-static."
+        exit 1
+    fi
+done
+
+for mode in sendfile mmap
+do
+    # kept-alive connections hold a worker each, so give every one its own
+    flags="-b -t ${CONNS}"
+    [ ${mode} == "mmap" ] && flags="${flags} -M"
+    tiny_port=`./free-port.sh`
+    (cd ./tiny; exec ./tiny ${flags} ${tiny_port} > /dev/null 2>&1) &
+    tiny_pid=$!
+    sleep 0.5
+    for file in ${FILES}
+    do
+        echo "== ${mode}: ${file} (`stat -c %s ./tiny/${file}` bytes)"
+        ./loadgen -k -c ${CONNS} -d ${SECONDS_PER_RUN} -N 1 "http://localhost:${tiny_port}/${file}"
+        echo ""
+    done
+    kill ${tiny_pid}
+    wait ${tiny_pid} 2> /dev/null
+done
+exit 0
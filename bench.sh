@@ -0,0 +1,63 @@
+#!/bin/bash
+#
+# bench.sh - Runs loadgen against the proxy in front of tiny on localhost.
+#     Three fixed scenarios (hit-heavy, miss-heavy, large objects), each
+#     with a fixed seed so runs are comparable.
+#
+#     usage: ./bench.sh [extra proxy args]
+#     env:   BENCH_SECONDS (default 10), BENCH_CONNS (default 16),
+#            BENCH_DELAY (origin latency in ms, default 0)
+#
+#     The origin is tiny in benchmark mode (-b), serving synthetic
+#     /bench/ objects, so it is never the bottleneck.
+#
+
+SECONDS_PER_RUN=${BENCH_SECONDS:-10}
+CONNS=${BENCH_CONNS:-16}
+DELAY=${BENCH_DELAY:-0}
+BENCH_DIR="./.bench"
+SMALL_OBJECTS=5000
+SMALL_SIZE=4096
+LARGE_OBJECTS=8
+LARGE_SIZE=$((2 << 20))
+
+function cleanup {
+    kill ${proxy_pid} ${tiny_pid} 2> /dev/null
+    wait 2> /dev/null
+}
+trap cleanup EXIT
+
+for prog in ./proxy ./loadgen ./tiny/tiny
+do
+    if [ ! -x ${prog} ]; then
+        echo "Error: ${prog} not found. Run make bench."
+        exit 1
+    fi
+done
+
+mkdir -p ${BENCH_DIR}
+tiny_port=`./free-port.sh`
+./tiny/tiny -b -l ${DELAY} ${tiny_port} > /dev/null 2>&1 &
+tiny_pid=$!
+sleep 0.5
+proxy_port=`./free-port.sh`
+./proxy "$@" ${proxy_port} > ${BENCH_DIR}/proxy.log 2>&1 &
+proxy_pid=$!
+sleep 0.5
+
+# scenario <name> <loadgen args...>
+function scenario {
+    name=$1
+    shift
+    echo "== ${name}"
+    ./loadgen -S 1 -c ${CONNS} -d ${SECONDS_PER_RUN} -x localhost:${proxy_port} "$@"
+    echo ""
+}
+
+ORIGIN="http://localhost:${tiny_port}"
+scenario "hit-heavy: zipf 1.1 over 100 small objects" \
+    -z 1.1 -N 100 "${ORIGIN}/bench/small%d?size=${SMALL_SIZE}"
+scenario "miss-heavy: uniform over ${SMALL_OBJECTS} small objects" \
+    -z 0 -N ${SMALL_OBJECTS} "${ORIGIN}/bench/small%d?size=${SMALL_SIZE}"
+scenario "large objects: uniform over ${LARGE_OBJECTS} x ${LARGE_SIZE} bytes" \
+    -z 0 -N ${LARGE_OBJECTS} "${ORIGIN}/bench/large%d?size=${LARGE_SIZE}"
@@ -0,0 +1,361 @@
+/*
+ * loadgen.c - HTTP load generator for benchmarking the proxy
+ *
+ *   usage: ./loadgen [options] <url_pattern>
+ *
+ *   url_pattern is a printf pattern with one %d, replaced by the rank of the
+ *   object picked for each request (0 = most popular), e.g.
+ *   "http://localhost:8000/bench/obj%d". Requests go through the proxy given
+ *   with -x, or straight to the URL's host without it.
+ *
+ *   Closed loop (default): each of -c connections sends its next request as
+ *   soon as the previous response is in. Open loop (-r rate): requests are
+ *   scheduled at a fixed total rate and latency is measured from the
+ *   scheduled send time, so a stalled server cannot hide its queueing
+ *   delay (no coordinated omission).
+ *
+ *   Ranks follow a Zipf distribution with exponent -z over -N objects
+ *   (-z 0 is uniform). Runs are reproducible for a given -S seed.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <stdatomic.h>
+#include "csapp.h"
+
+/* Latency histogram: 16 linear sub-buckets per power of two of microseconds */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+/* declaration for options */
+int conns = 8;               // -c: concurrent connections (threads)
+long total_requests = 0;     // -n: stop after this many requests (0 = use -d)
+double duration = 10;        // -d: seconds to run
+double rate = 0;             // -r: open loop at this many requests/s (0 = closed loop)
+int keepalive = 0;           // -k: reuse connections (HTTP/1.1)
+double zipf_s = 1.0;         // -z: Zipf exponent
+int nobjects = 1000;         // -N: distinct objects
+unsigned seed = 1;           // -S: random seed
+char *proxy_host = NULL, *proxy_port = NULL;   // -x host:port
+char *pattern;
+/* end of declaration */
+
+/* declaration for run state */
+double *zipf_cdf;
+atomic_long issued;          // requests handed out so far
+double start_ms, stop_ms;
+
+typedef struct worker_t {
+  pthread_t tid;
+  int id;
+  unsigned long done, errors, bytes;
+  unsigned long hist[HIST_BUCKETS];
+  double max_ms;
+} worker_t;
+/* end of declaration */
+
+double now_ms(void);
+void zipf_init(int n, double s);
+int zipf_pick(uint64_t *state);
+int hist_index(double ms);
+double hist_upper(int i);
+double percentile(unsigned long *hist, unsigned long total, double q);
+int connect_target(char *host, char *port);
+int do_request(int *fd, rio_t *rio, char *req, char *host, char *port, unsigned long *bytes);
+int read_response(rio_t *rio, int *reusable, unsigned long *bytes);
+int split_url(char *url, char *host, char *port, char *path);
+void *worker(void *vargp);
+
+int main(int argc, char **argv) {
+  worker_t *workers;
+  unsigned long done = 0, errors = 0, bytes = 0, hist[HIST_BUCKETS];
+  double elapsed, max_ms = 0;
+  char *colon;
+  int opt, i, j;
+
+  while ((opt = getopt(argc, argv, "c:n:d:r:kz:N:S:x:")) != -1) {
+    switch (opt) {
+    case 'c': conns = atoi(optarg); break;
+    case 'n': total_requests = atol(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'k': keepalive = 1; break;
+    case 'z': zipf_s = atof(optarg); break;
+    case 'N': nobjects = atoi(optarg); break;
+    case 'S': seed = atoi(optarg); break;
+    case 'x':
+      proxy_host = optarg;
+      if ((colon = strrchr(optarg, ':')) == NULL) {
+        fprintf(stderr, "-x wants host:port\n");
+        exit(1);
+      }
+      *colon = '\0';
+      proxy_port = colon + 1;
+      break;
+    default: optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1 || conns < 1 || nobjects < 1) {
+    fprintf(stderr, "usage: %s [-c conns] [-n requests | -d seconds] [-r rate] [-k] [-z zipf_s] "
+            "[-N objects] [-S seed] [-x proxy_host:port] <url_pattern>\n", argv[0]);
+    exit(1);
+  }
+  pattern = argv[optind];
+  signal(SIGPIPE, SIG_IGN);   // a server closing on us is an error, not a crash
+  zipf_init(nobjects, zipf_s);
+
+  workers = Calloc(conns, sizeof(worker_t));
+  start_ms = now_ms();
+  stop_ms = total_requests ? 0 : start_ms + duration * 1000;
+  for (i = 0; i < conns; i++) {
+    workers[i].id = i;
+    Pthread_create(&workers[i].tid, NULL, worker, &workers[i]);
+  }
+  memset(hist, 0, sizeof(hist));
+  for (i = 0; i < conns; i++) {
+    Pthread_join(workers[i].tid, NULL);
+    done += workers[i].done;
+    errors += workers[i].errors;
+    bytes += workers[i].bytes;
+    if (workers[i].max_ms > max_ms)
+      max_ms = workers[i].max_ms;
+    for (j = 0; j < HIST_BUCKETS; j++)
+      hist[j] += workers[i].hist[j];
+  }
+  elapsed = (now_ms() - start_ms) / 1000;
+
+  printf("%s loop, %d conns%s, zipf %.2f over %d objects\n",
+         rate ? "open" : "closed", conns, keepalive ? ", keep-alive" : "", zipf_s, nobjects);
+  printf("  requests %lu, errors %lu, %.2f s, %.0f req/s, %.2f MB/s\n",
+         done, errors, elapsed, done / elapsed, bytes / elapsed / (1 << 20));
+  printf("  latency ms: p50 %.3f  p90 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+         percentile(hist, done, 0.5), percentile(hist, done, 0.9), percentile(hist, done, 0.99),
+         percentile(hist, done, 0.999), max_ms);
+  free(workers);
+  free(zipf_cdf);
+  return errors ? 2 : 0;
+}
+
+void *worker(void *vargp) {
+  worker_t *w = (worker_t *)vargp;
+  char url[MAXLINE], host[MAXLINE], port[MAXLINE], path[MAXLINE], req[4 * MAXLINE];
+  char *thost, *tport;
+  uint64_t state = seed * 0x9E3779B97F4A7C15ull + w->id + 1;
+  long n;
+  double sent, lat;
+  int fd = -1;
+  rio_t rio;
+
+  while (1) {
+    n = atomic_fetch_add(&issued, 1);
+    if (total_requests ? n >= total_requests : now_ms() >= stop_ms)
+      break;
+    if (rate) {   // open loop: wait for this request's slot
+      sent = start_ms + n * 1000.0 / rate;
+      if (!total_requests && sent >= stop_ms)
+        break;
+      while ((lat = sent - now_ms()) > 0)
+        usleep((useconds_t)(lat * 1000));
+    }
+    else
+      sent = now_ms();
+
+    sprintf(url, pattern, zipf_pick(&state));
+    if (!split_url(url, host, port, path)) {
+      fprintf(stderr, "bad url %s\n", url);
+      exit(1);
+    }
+    thost = proxy_host ? proxy_host : host;
+    tport = proxy_host ? proxy_port : port;
+    sprintf(req, "GET %s HTTP/1.%d\r\nHost: %s:%s\r\nConnection: %s\r\n\r\n",
+            proxy_host ? url : path, keepalive, host, port, keepalive ? "keep-alive" : "close");
+
+    if (do_request(&fd, &rio, req, thost, tport, &w->bytes) < 0) {
+      w->errors++;
+      continue;
+    }
+    lat = now_ms() - sent;
+    w->done++;
+    w->hist[hist_index(lat)]++;
+    if (lat > w->max_ms)
+      w->max_ms = lat;
+  }
+  if (fd >= 0)
+    Close(fd);
+  return NULL;
+}
+
+/*
+ * do_request - send req on *fd (connecting first if needed) and read the
+ *   whole response. A kept-alive connection that the server has closed in
+ *   the meantime is retried once on a fresh one. Returns -1 on error.
+ */
+int do_request(int *fd, rio_t *rio, char *req, char *host, char *port, unsigned long *bytes) {
+  int reused, reusable, rc;
+
+  while (1) {
+    if (!(reused = *fd >= 0)) {
+      if ((*fd = connect_target(host, port)) < 0)
+        return -1;
+      Rio_readinitb(rio, *fd);
+    }
+    rc = rio_writen(*fd, req, strlen(req)) < 0 ? -2 : read_response(rio, &reusable, bytes);
+    if (rc < 0 || !keepalive || !reusable) {
+      Close(*fd);
+      *fd = -1;
+    }
+    if (rc == -2 && reused)
+      continue;   // the server had closed the idle connection
+    return rc < 0 ? -1 : 0;
+  }
+}
+
+/* Read one response. Returns 0 on success, -2 if the connection was closed
+   before the status line, -1 on other errors. */
+int read_response(rio_t *rio, int *reusable, unsigned long *bytes) {
+  char buf[MAXBUF];
+  long length = -1, chunk;
+  int chunked = 0, status = 0;
+  ssize_t n;
+
+  if ((n = rio_readlineb(rio, buf, MAXLINE)) <= 0)
+    return -2;
+  sscanf(buf, "%*s %d", &status);
+  *reusable = !strncmp(buf, "HTTP/1.1", 8);
+  while ((n = rio_readlineb(rio, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n")) {
+    if (!strncasecmp(buf, "Content-Length:", 15))
+      length = atol(buf + 15);
+    else if (!strncasecmp(buf, "Transfer-Encoding:", 18) && strstr(buf, "chunked"))
+      chunked = 1;
+    else if (!strncasecmp(buf, "Connection:", 11))
+      *reusable = strstr(buf, "close") == NULL;
+  }
+  if (n <= 0)
+    return -1;
+
+  if (chunked) {
+    while (1) {
+      if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+        return -1;
+      if ((chunk = strtol(buf, NULL, 16)) == 0)
+        break;
+      for (; chunk > 0; chunk -= n, *bytes += n)
+        if ((n = rio_readnb(rio, buf, chunk < MAXBUF ? chunk : MAXBUF)) <= 0)
+          return -1;
+      rio_readlineb(rio, buf, MAXLINE);   // CRLF after the chunk
+    }
+    while ((n = rio_readlineb(rio, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n"))
+      ;   // trailers
+  }
+  else if (length >= 0) {
+    for (; length > 0; length -= n, *bytes += n)
+      if ((n = rio_readnb(rio, buf, length < MAXBUF ? length : MAXBUF)) <= 0)
+        return -1;
+  }
+  else {   // delimited by close
+    while ((n = rio_readnb(rio, buf, MAXBUF)) > 0)
+      *bytes += n;
+    *reusable = 0;
+  }
+  return status >= 200 && status < 400 ? 0 : -1;
+}
+
+int connect_target(char *host, char *port) {
+  int fd = open_clientfd(host, port);
+
+  if (fd < 0)
+    fprintf(stderr, "cannot connect to %s:%s\n", host, port);
+  return fd;
+}
+
+/* Split http://host[:port]/path */
+int split_url(char *url, char *host, char *port, char *path) {
+  char *h, *p, *slash;
+
+  if (strncasecmp(url, "http://", 7))
+    return 0;
+  h = url + 7;
+  if ((slash = strchr(h, '/')) == NULL)
+    return 0;
+  strcpy(path, slash);
+  if ((p = memchr(h, ':', slash - h)) != NULL) {
+    sprintf(host, "%.*s", (int)(p - h), h);
+    sprintf(port, "%.*s", (int)(slash - p - 1), p + 1);
+  }
+  else {
+    sprintf(host, "%.*s", (int)(slash - h), h);
+    strcpy(port, "80");
+  }
+  return 1;
+}
+
+/* Precompute the Zipf CDF over ranks 0..n-1: P(k) ~ 1 / (k + 1)^s */
+void zipf_init(int n, double s) {
+  double sum = 0;
+  int k;
+
+  zipf_cdf = Malloc(n * sizeof(double));
+  for (k = 0; k < n; k++)
+    zipf_cdf[k] = (sum += 1.0 / pow(k + 1, s));
+  for (k = 0; k < n; k++)
+    zipf_cdf[k] /= sum;
+}
+
+int zipf_pick(uint64_t *state) {
+  double u;
+  int lo = 0, hi = nobjects - 1, mid;
+
+  *state ^= *state << 13;   // xorshift64
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  u = (*state >> 11) * (1.0 / 9007199254740992.0);
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (zipf_cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int hist_index(double ms) {
+  uint64_t v = ms > 0 ? (uint64_t)(ms * 1000) : 0;
+  int e;
+
+  if (v < HIST_SUB)
+    return v;
+  e = 63 - __builtin_clzll(v);
+  if (e > HIST_MAX_EXP)
+    return HIST_BUCKETS - 1;
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Exclusive upper bound of bucket i, in ms */
+double hist_upper(int i) {
+  int e;
+
+  if (i < HIST_SUB)
+    return (i + 1) / 1e3;
+  e = i / HIST_SUB + HIST_SUB_BITS - 1;
+  return (double)((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUB_BITS)) / 1e3;
+}
+
+double percentile(unsigned long *hist, unsigned long total, double q) {
+  unsigned long seen = 0;
+  int i;
+
+  if (!total)
+    return 0;
+  for (i = 0; i < HIST_BUCKETS - 1 && seen + hist[i] < q * total; i++)
+    seen += hist[i];
+  return hist_upper(i);
+}
+
+double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
@@ -1,30 +1,405 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <zlib.h>
 #include "csapp.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Frequency sketch used by the admission filter: one saturating counter per
+   slot, all halved every FREQ_SKETCH_SAMPLE increments so old popularity fades. */
+#define FREQ_SKETCH_SIZE 4096
+#define FREQ_SKETCH_SAMPLE (FREQ_SKETCH_SIZE * 8)
+
+/* Longest cache key (canonical URI, plus Vary values for a variant) */
+#define MAX_KEY_LEN 1024
+
+/* Slots of the table remembering which keys carry Vary (power of two) */
+#define VARY_SLOTS 4096
+
+/* Buckets of the lock-free lookup table (power of two) */
+#define CACHE_BUCKETS 1024
+
+/* Default chunk size for -C: chunks small enough for the RAM tier */
+#define DEFAULT_CHUNK_SIZE MAX_OBJECT_SIZE
+
+/* Disk tier: objects larger than a segment are never stored */
+#define DISK_SEGMENT_SIZE (64 << 20)
+#define DISK_BUCKETS 65536
+#define DEFAULT_DISK_MB 1024
+
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3";
 
 /* declaration for cache */
+/*
+ * Readers never lock: they find nodes through cache_table with atomic loads
+ * inside an epoch, take a reference, bump freq and set the CLOCK bit. Writers
+ * (admission and eviction) serialize on cache_mutex and own the prev/next
+ * ring and the GDSF priorities. Eviction only unlinks and drops the cache's
+ * own reference; the body is freed by whoever drops the last one, and the
+ * node itself goes to the epoch reclaimer.
+ */
 typedef struct cache_data {
   struct cache_data *prev;
   struct cache_data *next;
+  _Atomic(struct cache_data *) hnext;  // bucket chain, read without locks
   size_t body_size;
   void *src;
-  char uri[1024];
+  size_t hdrs_size;
+  char *hdrs;       // response line + headers, replayed on a hit
+  size_t size;      // charged to the cache: body + gzip variant
+  void *gz;         // gzip variant of src, NULL if none (-z)
+  size_t gz_size;
+  char *gz_hdrs;    // hdrs rewritten for gz
+  size_t gz_hdrs_size;
+  char uri[MAX_KEY_LEN];  // cache key: canonical uri (+ Vary values)
+  double cost;      // fetch latency from the origin (ms)
+  atomic_uint freq; // hits since admission (+ sketch estimate at admission)
+  atomic_int referenced;  // CLOCK bit, set by readers on every hit
+  double priority;  // GDSF key: clock + freq * cost / size
+  int victim;       // picked for eviction by the current admission
+  int mapped;       // src/hdrs point into a loaded snapshot, not the heap
+  time_t stored_at; // when the origin sent it (wall clock)
+  time_t expires;   // from Cache-Control max-age; 0 = no limit
+  atomic_int refcnt;  // 1 for the cache itself + 1 per in-flight sender
+  unsigned long retired_epoch;
 } cache_data;
 
 size_t total_cache_size = 0;
 cache_data *nil;
+_Atomic(cache_data *) cache_table[CACHE_BUCKETS];
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;  // serializes writers
+
+/* GDSF inflation value: priority of the last evicted object */
+double cache_clock = 0;
+
+unsigned char freq_sketch[FREQ_SKETCH_SIZE];
+unsigned freq_sketch_count = 0;
+
+/* cache statistics */
+typedef struct cache_stats_t {
+  atomic_ulong requests, hits;          // object hit ratio = hits / requests
+  atomic_ulong bytes_served, bytes_hit; // byte hit ratio = bytes_hit / bytes_served
+  unsigned long admitted, rejected, evictions;
+  atomic_ulong disk_hits, demotions;
+  atomic_ulong gzip_hits, gzip_saved;   // hits served gzipped, body bytes that saved
+} cache_stats_t;
+cache_stats_t cache_stats;
+/* end of declaration */
+
+/* declaration for disk tier */
+typedef struct disk_entry {
+  struct disk_entry *hnext;  // index bucket chain
+  struct disk_entry *snext;  // objects of the same segment
+  struct disk_segment *seg;
+  off_t offset;
+  size_t hdrs_size, body_size;
+  double cost;
+  time_t expires;
+  int dead;                  // removed from the index, segment not yet recycled
+  char uri[MAX_KEY_LEN];
+} disk_entry;
+
+typedef struct disk_segment {
+  int id, fd;
+  size_t used;               // append offset
+  atomic_int refcnt;         // 1 while live + 1 per writer or sender
+  disk_entry *entries;
+  struct disk_segment *next; // next younger segment
+} disk_segment;
+
+/* an append in progress */
+typedef struct disk_writer {
+  disk_segment *seg;
+  off_t offset, pos;
+  size_t hdrs_size, body_size;
+  double cost;
+  time_t expires;
+  int failed;
+  char uri[MAX_KEY_LEN];
+} disk_writer;
+
+/* a pinned object, ready to send */
+typedef struct disk_hit {
+  disk_segment *seg;
+  off_t offset;
+  size_t hdrs_size, body_size;
+  double cost;
+  time_t expires;
+} disk_hit;
+
+char *disk_dir = NULL;             // NULL: disk tier disabled
+size_t disk_max_segments, disk_nsegments, disk_objects, disk_bytes;   // objects/bytes: indexed now
+int disk_next_id = 0;
+disk_segment *disk_oldest, *disk_current;
+disk_entry *disk_table[DISK_BUCKETS];
+pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;  // guards index and segment list
+/* end of declaration */
+
+char *snapshot_path = NULL;        // -s: warm restart file
+
+/* declaration for range requests */
+typedef struct range_t {
+  int present;               // a single, well-formed bytes range was asked for
+  long first, last;          // bytes=first-last (last < 0: to the end)
+  long suffix;               // bytes=-suffix (the last bytes of the object)
+  char if_range[MAXLINE];    // If-Range validator, "" if none
+} range_t;
+
+/* one chunk of a large object, pinned in a tier or fresh from the origin */
+typedef struct chunk_t {
+  cache_data *node;          // RAM hit, or nil
+  disk_hit hit;              // disk hit if on_disk
+  int on_disk, storable;
+  char *body;                // fetched now; cached on release
+  char hdrs[MAXBUF];         // origin's 206 headers
+  size_t hdrs_size, size, total;
+  double cost;
+  time_t expires;
+  char key[MAXLINE];
+} chunk_t;
+
+size_t chunk_size = 0;             // -C: fetch Range misses in chunks of this size, 0 = off
+/* end of declaration */
+
+/* declaration for Vary */
+typedef struct vary_slot {
+  char key[MAX_KEY_LEN];     // primary key
+  char vary[256];            // its Vary header value
+} vary_slot;
+
+vary_slot vary_table[VARY_SLOTS];
+pthread_mutex_t vary_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* end of declaration */
+
+/* declaration for content encoding */
+#define GZIP_MIN_SIZE 256          // smaller bodies don't pay for the extra headers
+int gzip_level = 0;                // -z: zlib level of cached gzip variants, 0 = off
+/* end of declaration */
+
+/* declaration for epoch-based reclamation */
+/*
+ * A reader publishes the global epoch it saw while it may hold cache
+ * pointers. The epoch only advances once every active reader has caught up,
+ * so a node retired at epoch e is unreachable by anyone once the global
+ * epoch reaches e + 2.
+ */
+typedef struct epoch_rec {
+  atomic_ulong epoch;  // 0 while quiescent
+  atomic_int in_use;
+  struct epoch_rec *next;
+} epoch_rec;
+
+atomic_ulong global_epoch = 1;
+_Atomic(epoch_rec *) epoch_recs;   // push-only; records are recycled, never freed
+_Atomic(cache_data *) limbo;       // retired nodes, chained by next; pushed lock-free
+static __thread epoch_rec *my_epoch;
+/* end of declaration */
+
+/* declaration for logging */
+/*
+ * Every thread appends finished lines to its own ring and only the log
+ * writer thread consumes them, so neither side takes a lock and a slow
+ * stdout never stalls a request. Rings are recycled like epoch records.
+ */
+#define LOG_RING_SIZE (64 << 10)   // bytes per thread, power of two
+#define LOG_IDLE_US 1000           // writer naps this long when all rings are empty
+
+enum { LOG_INFO, LOG_DEBUG };      // access lines / request and cache dumps (-v)
+
+typedef struct log_ring {
+  char buf[LOG_RING_SIZE];
+  atomic_size_t head;   // advanced by the owning thread
+  atomic_size_t tail;   // advanced by the writer
+  atomic_int in_use;
+  struct log_ring *next;
+} log_ring;
+
+_Atomic(log_ring *) log_rings;     // push-only; rings are recycled, never freed
+atomic_ulong log_dropped;          // records lost to a full ring
+int log_level = LOG_INFO;
+static __thread log_ring *my_log;
+
+/* phases of a request, stamped by trace_mark() */
+enum {
+  T_ACCEPT,     // accept() returned
+  T_THREAD,     // connection thread started
+  T_REQUEST,    // request line and headers read
+  T_LOOKUP,     // cache lookup done
+  T_UPSTREAM,   // started contacting the origin
+  T_RESOLVED,   // getaddrinfo done
+  T_CONNECTED,  // TCP connect done
+  T_SENT,       // request written to the origin
+  T_STATUS,     // origin status line read
+  T_FETCHED,    // origin body read
+  T_HEAD,       // first response byte written to the client
+  T_BODY,       // response body written to the client
+  T_DONE,       // connection closed
+  T_COUNT
+};
+
+/* what the access line, the metrics and the slow-request trace report
+   about the current request */
+typedef struct access_rec {
+  char method[16];
+  char uri[MAXLINE];
+  int status;
+  size_t bytes;
+  size_t origin_bytes;  // body bytes read from the origin
+  char *cache;          // "hit", "disk" or "miss"
+  int io_error;         // errno of the first failed read or write, 0 if none
+  double upstream_ms;   // time spent on the origin, -1 if not contacted
+  double t[T_COUNT];    // now_ms() at each phase, 0 if not reached
+} access_rec;
+
+double slow_ms = -1;    // -T: trace requests slower than this, -1 = off
+
+static __thread access_rec my_access;
+/* end of declaration */
+
+/* declaration for metrics */
+#define HIST_SUB_BITS 4                  // 16 sub-buckets per power of two
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40                  // ~12 days in microseconds
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+#define METRICS_BUF (64 << 10)
+
+enum { HIST_FIRST_BYTE, HIST_DNS, HIST_CONNECT, HIST_TTFB, HIST_TOTAL, HIST_COUNT };
+
+typedef struct metrics_rec {
+  atomic_ulong hist[HIST_COUNT][HIST_BUCKETS];
+  atomic_ulong sum_us[HIST_COUNT];
+  atomic_ulong origin_bytes;
+  atomic_int in_use;
+  struct metrics_rec *next;
+} metrics_rec;
+
+_Atomic(metrics_rec *) metrics_recs;  // push-only; blocks are recycled, never freed
+atomic_int active_connections;
+atomic_ulong io_errors;               // connections that lost a peer mid-transfer, disk tier failures
+atomic_ulong accept_errors, spawn_errors;
+/* end of declaration */
+
+/* declaration for per-client limits */
+/*
+ * Clients are counted by address in a hash whose buckets are guarded by
+ * LIMIT_STRIPES mutexes, so the accept loop and finishing connections
+ * rarely wait on each other. An entry holds the client's open connections
+ * and a token bucket refilled at rate_limit per second up to rate_burst.
+ */
+#define LIMIT_BUCKETS 4096         // power of two
+#define LIMIT_STRIPES 64           // power of two, divides LIMIT_BUCKETS
+
+typedef struct client_id {
+  int family;
+  unsigned char addr[16];          // IPv4 addresses use the first 4 bytes
+} client_id;
+
+typedef struct limit_entry {
+  struct limit_entry *next;
+  client_id id;
+  int conns;                       // connections being served
+  double tokens, stamp;            // bucket level as of now_ms() == stamp
+} limit_entry;
+
+limit_entry *limit_table[LIMIT_BUCKETS];
+pthread_mutex_t limit_locks[LIMIT_STRIPES];
+int max_client_conns = 0;          // -L: connections per client, 0 = unlimited
+double rate_limit = 0;             // -R: requests per second per client, 0 = unlimited
+double rate_burst = 0;             // -B: bucket size, default max(rate_limit, 1)
+atomic_ulong limited_conns, limited_requests;   // refused with 503 / 429
+/* end of declaration */
+
+/* declaration for load shedding */
+/*
+ * CoDel applied to admission: a connection's sojourn is how long its
+ * request has been waiting when its thread starts on it. The listeners set
+ * SO_TIMESTAMPNS, so the kernel stamps the request's first bytes when they
+ * arrive; that covers the accept backlog as well as our thread start. A
+ * connection whose request is not in yet falls back to the time since
+ * accept. If even the shortest sojourn of an
+ * interval stayed above codel_target, the backlog is standing rather than
+ * a burst, and for the next interval connections that waited over twice
+ * the target are turned away with 503 instead of slowing everyone down.
+ */
+#define CODEL_INTERVAL_MS 100.0
+
+double codel_target = 0;           // -Q: target sojourn in ms, 0 = never shed
+double codel_min = -1;             // shortest sojourn this interval, -1 = none yet
+double codel_interval_end = 0;
+int codel_overloaded = 0;
+pthread_mutex_t codel_mutex = PTHREAD_MUTEX_INITIALIZER;
+atomic_ulong shed_conns;           // refused by codel_shed
+/* end of declaration */
+
+/* declaration for timeouts */
+/*
+ * Connection threads block in read() and write(), so a stalled peer is dealt
+ * with from outside: a timer armed on its fd shuts it down when it expires,
+ * and the blocked read returns EOF (or the write fails). While the response
+ * is sent, client_timer is an idle timer that every bit of progress to the
+ * client pushes back, so a client that stops reading is cut off. Timers sit on a two-level
+ * hashed wheel (TIMER_SLOTS ticks, then TIMER_SLOTS slots of TIMER_SLOTS
+ * ticks each), so arming and cancelling are O(1) list operations.
+ */
+#define TIMER_TICK_MS 10
+#define TIMER_SLOTS 256            // power of two; the outer wheel spans ~11 minutes
+
+typedef struct io_timer {
+  struct io_timer *next, *prev;    // NULL while not pending
+  unsigned long expires;           // tick
+  int fd, fired;
+  int how;                         // shutdown() it with SHUT_RD or SHUT_RDWR
+  double ms;                       // what it was armed with, for timer_touch
+} io_timer;
+
+io_timer timer_wheel[2][TIMER_SLOTS];   // list heads
+unsigned long timer_tick = 0;
+pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+double header_timeout = 10000;     // -H: ms for a client to send its request headers
+double connect_timeout = 5000;     // -K: ms to connect to an origin
+double origin_timeout = 30000;     // -O: ms an origin may go silent while we read it
+double send_timeout = 60000;       // -W: ms a response may make no progress; above -O, so a
+                                   //     silent origin still gets its 504
+atomic_ulong timeouts;             // timers that fired
+
+static __thread io_timer client_timer, origin_timer;
+/* end of declaration */
+
+/* declaration for accept sharding */
+/*
+ * With -A n the proxy opens n SO_REUSEPORT listeners on its port, each
+ * drained by its own acceptor thread, so accepting is no longer one
+ * thread's job. With -P as well, acceptor i is pinned to CPU i mod ncpu,
+ * so the acceptors don't crowd onto one core. The connection threads they
+ * start would inherit that pinning; they put the process's own CPU mask
+ * back first, so the scheduler still spreads connections over every core.
+ * A single acceptor is never pinned.
+ */
+typedef struct acceptor_t {
+  int listenfd;
+  int cpu;                         // pinned to this CPU, -1 = not pinned
+} acceptor_t;
+
+int n_acceptors = 1;               // -A: SO_REUSEPORT listeners, each with its own accept loop
+int pin_acceptors = 0;             // -P: pin acceptor i to CPU i
+unsigned long cpu_mask_all[1024 / (8 * sizeof(unsigned long))];   // the mask before pinning
+int limiting = 0;                  // per-client limits are on
 /* end of declaration */
 
 /* declaration for thread variable arguments*/
 typedef struct vargs_t {
    int connfd;
+   client_id client;  // valid if limiting
+   double accepted;   // now_ms() at accept
    char hostname[MAXLINE], port[MAXLINE];
 } vargs_t;
 /* end of declaration for thread variable arguments */
@@ -35,70 +410,383 @@ int parse_uri(char *uri, char *host, char *port, char *filename);
 void forward_request(int clientfd, char *method, char *filename, char *host, char *port, char *headers);
 
 cache_data *is_cached(char *uri);
-void serve_fresh_response(rio_t *rp, int connfd, char *uri);
-void serve_cached_response(int fd, cache_data *node);
-void do_cache(void *srcp, size_t src_size, char *uri);
+void serve_fresh_response(rio_t *rp, int connfd, char *key, double fetch_start, range_t *range,
+                          char *req_headers);
+int cache_key(char *uri, char *key);
+int vary_key(char *key, char *vary, char *req_headers, char *out);
+void vary_remember(char *key, char *vary);
+int vary_lookup(char *key, char *req_headers, char *out);
+void cache_remove(char *key);
+void disk_remove(char *key);
+time_t parse_freshness(char *value, int *cacheable);
+char *find_token(char *s, char *token);
+size_t relay_body(rio_t *rp, int connfd, ssize_t len, disk_writer *w, size_t from, size_t to);
+void serve_cached_response(int fd, cache_data *node, range_t *range, int gzip);
+cache_data *cache_get(char *uri);
+void cache_put(cache_data *node);
+int do_cache(void *srcp, size_t src_size, char *hdrs, size_t hdrs_size, char *uri, double cost,
+             time_t expires, int encode);
+void cache_insert(cache_data *node);
+int cache_expired(cache_data *node);
 void push_cache_node(cache_data *node);
 void delete_cache_node(cache_data *node);
+double gdsf_priority(unsigned freq, double cost, size_t size);
+unsigned sketch_touch(char *uri);
+unsigned sketch_estimate(char *uri);
+void print_cache_stats(void);
+double now_ms(void);
+unsigned long cache_hash(char *uri);
+void cache_unlink(cache_data *node);
+
+void disk_init(char *dir, size_t capacity_mb);
+int disk_begin(disk_writer *w, char *uri, char *hdrs, size_t hdrs_size, size_t body_size, double cost,
+               time_t expires);
+void disk_write(disk_writer *w, void *buf, size_t n);
+void disk_commit(disk_writer *w);
+int disk_get(char *uri, disk_hit *hit);
+void serve_disk_response(int fd, disk_hit *hit, range_t *range);
+void disk_promote(disk_hit *hit, char *uri);
+void disk_demote(cache_data *node);
+
+int header_value(char *hdrs, size_t size, char *name, char *out, size_t outsize);
+void strip_header(char *headers, char *name);
+void parse_range(char *headers, range_t *range);
+int range_applies(range_t *range, char *hdrs, size_t hdrs_size);
+int resolve_range(range_t *range, size_t total, size_t *from, size_t *to);
+void send_partial_headers(int fd, char *hdrs, size_t hdrs_size, size_t from, size_t to, size_t total);
+void send_unsatisfiable(int fd, size_t total);
+void send_head(int fd, char *hdrs, size_t hdrs_size, size_t total, range_t *range,
+               size_t *from, size_t *to);
+void sendfile_all(int out_fd, int in_fd, off_t off, size_t len);
+int serve_chunked_range(int fd, char *uri, char *host, char *port, char *filename, char *headers,
+                        range_t *range);
+
+int compressible(char *hdrs, size_t hdrs_size, size_t body_size);
+int accepts_gzip(char *req_headers);
+size_t gzip_body(void *src, size_t size, void **out);
+size_t gzip_headers(char *hdrs, size_t hdrs_size, size_t gz_size, char *out);
+
+int snapshot_save(char *path);
+int snapshot_load(char *path);
+void *snapshot_thread(void *vargp);
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_release(void);
+void epoch_retire(cache_data *node);
+void epoch_reclaim(void);
+
+void log_write(int level, char *data, size_t len);
+void log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_release(void);
+void *log_thread(void *vargp);
+void log_flush(void);
+void log_access(char *hostname, char *port);
+
+void metrics_record(void);
+void note_head(int status);
+void trace_mark(int phase);
+double trace_span(int from, int to);
+void trace_dump(char *hostname, char *port);
+int open_origin(char *host, char *port);
+void *metrics_thread(void *vargp);
+
+void client_key(struct sockaddr_storage *sa, client_id *id);
+int limit_admit(client_id *id);
+void limit_release(client_id *id);
+void limit_reject(int fd, int status);
+void send_refusal(int fd, int status);
+int codel_shed(double sojourn, double now);
+double queued_ms(int fd);
+void timer_arm(io_timer *t, int fd, double ms, int how);
+void timer_touch(io_timer *t);
+void timer_cancel(io_timer *t);
+void timer_init(void);
+void *timer_thread(void *vargp);
+void close_origin(int fd);
+
+int io_writen(int fd, void *buf, size_t n);
+ssize_t io_readlineb(rio_t *rp, void *buf, size_t maxlen);
+ssize_t io_readnb(rio_t *rp, void *buf, size_t n);
+void io_failed(char *op);
+void io_close(int fd);
+
+void *acceptor(void *vargp);
+int open_listener(char *port, int reuseport);
+int pin_to_cpu(int cpu);
+int set_affinity(unsigned long *mask);
 
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 void *thread(void *vargp);
 
 int main(int argc, char **argv) {
-  int listenfd, connfd;
-  char hostname[MAXLINE], port[MAXLINE];
-  socklen_t clientlen; struct sockaddr_storage clientaddr;
+  int adminfd;
+  char *admin_port = NULL;
   pthread_t tid;
-  vargs_t *vargs;
+  acceptor_t *acceptors;
+  char *disk = NULL;
+  size_t disk_mb = DEFAULT_DISK_MB;
+  int opt, n, one = 1;
+  sigset_t snap_mask;
+  double start;
 
   /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  while ((opt = getopt(argc, argv, "d:D:s:C:m:T:z:L:R:B:Q:H:K:O:W:A:Pv")) != -1) {
+    switch (opt) {
+    case 'A': n_acceptors = atoi(optarg); break;  // accept on this many SO_REUSEPORT listeners
+    case 'P': pin_acceptors = 1; break;  // pin each acceptor thread to its own CPU
+    case 'H': header_timeout = atof(optarg); break;  // ms to read a request's headers, 0 = none
+    case 'K': connect_timeout = atof(optarg); break;  // ms to connect to an origin, 0 = none
+    case 'O': origin_timeout = atof(optarg); break;  // ms an origin may stall mid-response, 0 = none
+    case 'W': send_timeout = atof(optarg); break;  // ms a response may stall, 0 = none
+    case 'Q': codel_target = atof(optarg); break;  // shed connections once queueing exceeds this
+    case 'L': max_client_conns = atoi(optarg); break;  // open connections per client address
+    case 'R': rate_limit = atof(optarg); break;  // requests per second per client address
+    case 'B': rate_burst = atof(optarg); break;  // requests a client may burst above -R
+    case 'z': gzip_level = atoi(optarg); break;  // keep gzip variants of text, at this zlib level
+    case 'T': slow_ms = atof(optarg); break;  // log phase timings of requests slower than this
+    case 'm': admin_port = optarg; break;    // serve /metrics on this port
+    case 'v': log_level = LOG_DEBUG; break;  // dump headers and the cache per request
+    case 'C': chunk_size = atol(optarg) << 10; break;  // chunk size in KB for Range misses
+    case 'd': disk = optarg; break;           // directory for the disk tier
+    case 'D': disk_mb = atol(optarg); break;  // disk tier capacity in MB
+    case 's': snapshot_path = optarg; break;  // snapshot file for warm restarts
+    default: optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-v] [-d cache_dir] [-D disk_mb] [-s snapshot_file] [-C chunk_kb] "
+            "[-m admin_port] [-T slow_ms] [-z gzip_level] [-L conns_per_client] [-R req_per_sec] "
+            "[-B burst] [-Q target_ms] [-H header_ms] [-K connect_ms] [-O origin_ms] [-W send_ms] [-A acceptors] [-P] "
+            "<port>\n",
+            argv[0]);
     exit(1);
   }
+  if (disk)
+    disk_init(disk, disk_mb);
+  if (rate_burst < 1)
+    rate_burst = rate_limit > 1 ? rate_limit : 1;
+  limiting = max_client_conns > 0 || rate_limit > 0;
+  for (n = 0; n < LIMIT_STRIPES; n++)
+    pthread_mutex_init(&limit_locks[n], NULL);
 
   // init sentinel node
   nil = (cache_data *)malloc(sizeof(cache_data));
   nil->next = nil; nil->prev = nil;
 
-  listenfd = Open_listenfd(argv[1]);
+  if (snapshot_path) {
+    start = now_ms();
+    n = snapshot_load(snapshot_path);
+    log_msg(LOG_INFO, "@ Loaded %d cached objects from %s in %.1f ms\n", n, snapshot_path, now_ms() - start);
+    /* every thread inherits this mask, so only snapshot_thread sees the signals */
+    sigemptyset(&snap_mask);
+    sigaddset(&snap_mask, SIGTERM);
+    sigaddset(&snap_mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &snap_mask, NULL);
+    Pthread_create(&tid, NULL, snapshot_thread, &snap_mask);
+  }
+  Pthread_create(&tid, NULL, log_thread, NULL);
+  timer_init();
+  Pthread_create(&tid, NULL, timer_thread, NULL);
+  Signal(SIGPIPE, SIG_IGN);   // a client that went away is not worth dying for
+  if (admin_port) {
+    adminfd = Open_listenfd(admin_port);
+    Pthread_create(&tid, NULL, metrics_thread, &adminfd);
+  }
+
+  /* with -A, one SO_REUSEPORT listener per acceptor: the kernel spreads connections over them */
+  if (n_acceptors < 1)
+    n_acceptors = 1;
+  acceptors = Malloc(n_acceptors * sizeof(acceptor_t));
+  for (n = 0; n < n_acceptors; n++) {
+    acceptors[n].listenfd = n_acceptors > 1 ? open_listener(argv[optind], 1) : Open_listenfd(argv[optind]);
+    acceptors[n].cpu = pin_acceptors && n_acceptors > 1 ? n % sysconf(_SC_NPROCESSORS_ONLN) : -1;
+    if (codel_target > 0)   // accepted sockets inherit it: requests get arrival stamps for codel
+      setsockopt(acceptors[n].listenfd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(int));
+  }
+  if (acceptors[0].cpu >= 0 && syscall(SYS_sched_getaffinity, 0, sizeof(cpu_mask_all), cpu_mask_all) < 0)
+    memset(cpu_mask_all, 0xff, sizeof(cpu_mask_all));   // unknown: allow every CPU
+  for (n = 1; n < n_acceptors; n++)
+    Pthread_create(&tid, NULL, acceptor, &acceptors[n]);
+  acceptor(&acceptors[0]);
+  free(nil);
+}
+/*
+ * Accept loop: runs in main for the single listener, or in one thread per
+ * SO_REUSEPORT listener with -A.
+ */
+void *acceptor(void *vargp) {
+  acceptor_t *a = (acceptor_t *)vargp;
+  int listenfd = a->listenfd, connfd, status;
+  char hostname[MAXLINE], port[MAXLINE];
+  socklen_t clientlen; struct sockaddr_storage clientaddr;
+  pthread_t tid;
+  vargs_t *vargs;
+  client_id client;
+  double start;
+
+  if (a->cpu >= 0 && pin_to_cpu(a->cpu) < 0)
+    log_msg(LOG_INFO, "@ Could not pin acceptor to CPU %d: %s\n", a->cpu, strerror(errno));
   while (1) {
     clientlen = sizeof(clientaddr);
 
-    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-    Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-    printf("@ Accepted connection from (%s, %s)\n", hostname, port);
+    if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+      atomic_fetch_add(&accept_errors, 1);
+      if (errno == EMFILE || errno == ENFILE)
+        usleep(10000);   // out of descriptors: let connections finish rather than spin
+      continue;
+    }
+    start = now_ms();
+    // refuse before anything costly happens for an abusive client
+    if (limiting) {
+      client_key(&clientaddr, &client);
+      if ((status = limit_admit(&client)) != 0) {
+        limit_reject(connfd, status);
+        continue;
+      }
+    }
+    if (getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE,
+                    NI_NUMERICHOST | NI_NUMERICSERV)) {   // no reverse DNS in the accept loop
+      strcpy(hostname, "?");
+      strcpy(port, "?");
+    }
+    log_msg(LOG_DEBUG, "@ Accepted connection from (%s, %s)\n", hostname, port);
 
     vargs = (vargs_t *)malloc(sizeof(vargs_t));
     strcpy(vargs->hostname, hostname);
     strcpy(vargs->port, port);
     vargs->connfd = connfd;
-    Pthread_create(&tid, NULL, thread, (void *)vargs);
+    vargs->accepted = start;
+    vargs->client = limiting ? client : (client_id){0};
+    if (pthread_create(&tid, NULL, thread, (void *)vargs)) {   // out of threads: refuse, don't die
+      atomic_fetch_add(&spawn_errors, 1);
+      send_refusal(connfd, 503);
+      close(connfd);
+      if (limiting)
+        limit_release(&client);
+      free(vargs);
+    }
   }
-  free(nil);
+  return NULL;
+}
+
+/*
+ * open_listener - open_listenfd, with SO_REUSEPORT if reuseport so that
+ *   several sockets can listen on port at once. Exits on failure, like
+ *   Open_listenfd.
+ */
+int open_listener(char *port, int reuseport) {
+  struct addrinfo hints, *listp, *p;
+  int listenfd = -1, optval = 1, rc;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;             // accept connections
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;   // on any IP address
+  if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+    fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+    exit(1);
+  }
+  for (p = listp; p; p = p->ai_next) {
+    if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    if (reuseport)
+      setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+    if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0 && listen(listenfd, LISTENQ) == 0)
+      break;   // success
+    close(listenfd);
+    listenfd = -1;
+  }
+  freeaddrinfo(listp);
+  if (listenfd < 0) {
+    fprintf(stderr, "cannot listen on port %s: %s\n", port, strerror(errno));
+    exit(1);
+  }
+  return listenfd;
+}
+
+/* pin_to_cpu - bind the calling thread to cpu. */
+int pin_to_cpu(int cpu) {
+  unsigned long mask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+
+  if (cpu >= 1024)
+    return -1;
+  mask[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+  return set_affinity(mask);
+}
+
+/* Set the calling thread's CPU mask (1024 bits). */
+int set_affinity(unsigned long *mask) {
+  return syscall(SYS_sched_setaffinity, 0, sizeof(cpu_mask_all), mask) < 0 ? -1 : 0;
 }
+
 /* Tread routine */
 void *thread(void *vargp) {
   vargs_t *vargs = (vargs_t *)vargp;
   char hostname[MAXLINE], port[MAXLINE];
   cache_data *node; int n;
+  client_id client = vargs->client;
+  double sojourn, queued;
 
   int connfd = vargs->connfd;
   strcpy(hostname, vargs->hostname);
   strcpy(port, vargs->port);
   Pthread_detach(pthread_self());
+  if (pin_acceptors && n_acceptors > 1)
+    set_affinity(cpu_mask_all);   // don't stay on our acceptor's core
+
+  memset(&my_access, 0, sizeof(my_access));
+  my_access.t[T_ACCEPT] = vargs->accepted;
+  trace_mark(T_THREAD);
+  my_access.upstream_ms = -1;
   Free(vargp);
+  atomic_fetch_add(&active_connections, 1);
 
-  doit(connfd);
+  sojourn = my_access.t[T_THREAD] - my_access.t[T_ACCEPT];
+  if (codel_target > 0 && (queued = queued_ms(connfd)) > sojourn)
+    sojourn = queued;   // it sat in the accept backlog too
+  if (codel_target > 0 && codel_shed(sojourn, my_access.t[T_THREAD])) {
+    atomic_fetch_add(&shed_conns, 1);
+    send_refusal(connfd, 503);
+  }
+  else
+    doit(connfd);
 
-  Close(connfd);
-  printf("@ Close connection to (%s, %s)\n", hostname, port);
-  printf("<CACHE LIST> total_cache_size : %d\n", total_cache_size);\
-  node = nil; n = 1;
-  while((node = node->next) != nil) {
-    printf("%d) %-40s  ->  %d bytes\n", n++, node->uri, node->body_size);
+  timer_cancel(&client_timer);
+  io_close(connfd);
+  trace_mark(T_DONE);
+  atomic_fetch_sub(&active_connections, 1);
+  if (client.family)
+    limit_release(&client);
+  log_access(hostname, port);
+  metrics_record();
+  trace_dump(hostname, port);
+  log_msg(LOG_DEBUG, "@ Close connection to (%s, %s)\n", hostname, port);
+  if (log_level >= LOG_DEBUG) {
+    pthread_mutex_lock(&cache_mutex);
+    epoch_reclaim();
+    log_msg(LOG_DEBUG, "<CACHE LIST> total_cache_size : %zu\n", total_cache_size);
+    node = nil; n = 1;
+    while((node = node->next) != nil) {
+      log_msg(LOG_DEBUG, "%d) %-40s  ->  %zu bytes  (freq %u, cost %.1f ms, H %.4f)\n",
+              n++, node->uri, node->body_size, node->freq, node->cost, node->priority);
+    }
+    print_cache_stats();
+    pthread_mutex_unlock(&cache_mutex);
+  } else if (atomic_load(&limbo) && pthread_mutex_trylock(&cache_mutex) == 0) {
+    // only when nodes wait to be freed; a busy lock means do_cache will reclaim them
+    epoch_reclaim();
+    pthread_mutex_unlock(&cache_mutex);
+  }
+  if (disk_dir && log_level >= LOG_DEBUG) {
+    pthread_mutex_lock(&disk_mutex);
+    log_msg(LOG_DEBUG, "<DISK TIER> %zu objects, %zu bytes in %zu/%zu segments\n",
+            disk_objects, disk_bytes, disk_nsegments, disk_max_segments);
+    pthread_mutex_unlock(&disk_mutex);
   }
-  printf("\n");
+  log_msg(LOG_DEBUG, "\n");
+  epoch_release();
+  log_release();
   return NULL;
 }
 
@@ -117,9 +805,9 @@ void forward_request(int clientfd, char *method, char *filename, char *host, cha
   strcat(buf, headers);
 
   // send
-  Rio_writen(clientfd, buf, strlen(buf));
-    printf(">>>>>>>> Request headers to server\n");
-    printf("%s", buf);
+  io_writen(clientfd, buf, strlen(buf));
+    log_msg(LOG_DEBUG, ">>>>>>>> Request headers to server\n");
+    log_msg(LOG_DEBUG, "%s", buf);
 }
 
 void doit(int fd) {
@@ -127,16 +815,28 @@ void doit(int fd) {
   char buf[MAXLINE];
   char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
   char host[MAXLINE], port[MAXLINE], filename[MAXLINE];
+  char key[MAX_KEY_LEN], variant[MAX_KEY_LEN], *lookup;
   rio_t rio;
-  cache_data *node;
+  cache_data *node = nil;
+  disk_hit hit;
+  range_t range;
+  double fetch_start;
+  int have_key, on_disk = 0;
 
   /* Read request line and headers */
+  timer_arm(&client_timer, fd, header_timeout, SHUT_RD);
   Rio_readinitb(&rio, fd);            // 새로운 rio (connfd).
-  Rio_readlineb(&rio, buf, MAXLINE);  // 첫번째 줄(request line) 읽어서 buf에 넣어줌.
-  printf("<Incoming Request headers>\n");
-  printf("%s", buf);
+  if (io_readlineb(&rio, buf, MAXLINE) <= 0) {  // 첫번째 줄(request line) 읽어서 buf에 넣어줌.
+    if (client_timer.fired)
+      clienterror(fd, "", "408", "Request Timeout", "The request took too long to arrive");
+    return;
+  }
+  log_msg(LOG_DEBUG, "<Incoming Request headers>\n");
+  log_msg(LOG_DEBUG, "%s", buf);
     
   sscanf(buf, "%s %s %s", method, uri, version); // buf에서 띄어쓰기로 구분된 문자열 3개를 읽어서 뒤의 변수에 넣어줌.
+  snprintf(my_access.method, sizeof(my_access.method), "%.15s", method);
+  strcpy(my_access.uri, uri);
   if(!strlen(method) || !strlen(uri) || !strlen(version)) {
     clienterror(fd, method, "400", "Bad request",
       "Request could not be understood by the server");
@@ -145,20 +845,57 @@ void doit(int fd) {
 
   strcpy(buf, "");
   if (!collect_requesthdrs(&rio, buf)) {  // valid check, find addintional header
-    clienterror(fd, method, "400", "Bad request",
-              "Request could not be understood by the server");
+    if (client_timer.fired)
+      clienterror(fd, method, "408", "Request Timeout", "The request took too long to arrive");
+    else
+      clienterror(fd, method, "400", "Bad request",
+                "Request could not be understood by the server");
     return;    
   }
+  // from here on only our writes can stall: give up on a client that stops reading
+  timer_cancel(&client_timer);
+  timer_arm(&client_timer, fd, send_timeout, SHUT_RDWR);
+  parse_range(buf, &range);
+  trace_mark(T_REQUEST);
   /* end of Read request line and headers */
 
   /* Make response */
+  // look the canonical key up in both tiers; on a miss, try the variant for
+  // this request in case the object carries Vary
+  cache_stats.requests++;
+  if ((have_key = cache_key(uri, key))) {
+    if ((node = cache_get(key)) == nil && !(on_disk = disk_get(key, &hit))
+        && vary_lookup(key, buf, variant)) {
+      lookup = variant;
+      if ((node = cache_get(lookup)) == nil)
+        on_disk = disk_get(lookup, &hit);
+    }
+    else
+      lookup = key;
+  }
+  trace_mark(T_LOOKUP);
   // if this request is cached:
-  if ((node = is_cached(uri)) != nil) {
-    printf("\n                   ██████╗ █████╗  ██████╗██╗  ██╗███████╗    ██╗  ██╗██╗████████╗    ██╗\n ░▄▌░░░░░░░░░▄    ██╔════╝██╔══██╗██╔════╝██║  ██║██╔════╝    ██║  ██║██║╚══██╔══╝    ██║\n ████████████▄    ██║     ███████║██║     ███████║█████╗      ███████║██║   ██║       ██║\n ░░░░░░░░▀▐████   ██║     ██╔══██║██║     ██╔══██║██╔══╝      ██╔══██║██║   ██║       ╚═╝\n ░░░░░░░░░░░▐██▌  ╚██████╗██║  ██║╚██████╗██║  ██║███████╗    ██║  ██║██║   ██║       ██╗\n                   ╚═════╝╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝╚══════╝    ╚═╝  ╚═╝╚═╝   ╚═╝       ╚═╝\n\n");
-    serve_cached_response(fd, node);
+  if (node != nil) {
+    my_access.cache = "hit";
+    log_msg(LOG_DEBUG, "\n                   ██████╗ █████╗  ██████╗██╗  ██╗███████╗    ██╗  ██╗██╗████████╗    ██╗\n ░▄▌░░░░░░░░░▄    ██╔════╝██╔══██╗██╔════╝██║  ██║██╔════╝    ██║  ██║██║╚══██╔══╝    ██║\n ████████████▄    ██║     ███████║██║     ███████║█████╗      ███████║██║   ██║       ██║\n ░░░░░░░░▀▐████   ██║     ██╔══██║██║     ██╔══██║██╔══╝      ██╔══██║██║   ██║       ╚═╝\n ░░░░░░░░░░░▐██▌  ╚██████╗██║  ██║╚██████╗██║  ██║███████╗    ██║  ██║██║   ██║       ██╗\n                   ╚═════╝╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝╚══════╝    ╚═╝  ╚═╝╚═╝   ╚═╝       ╚═╝\n\n");
+    serve_cached_response(fd, node, &range, accepts_gzip(buf));
+    cache_put(node);
+  }
+  // on the disk tier:
+  else if (on_disk) {
+    my_access.cache = "disk";
+    serve_disk_response(fd, &hit, &range);
+    disk_promote(&hit, lookup);
   }
   // not cached:
   else {
+    my_access.cache = "miss";
+    if (have_key) {
+      pthread_mutex_lock(&cache_mutex);
+      sketch_touch(key);   // remember the miss so a popular object can win admission later
+      pthread_mutex_unlock(&cache_mutex);
+    }
+
     /* make request to server */
     if (!parse_uri(uri, host, port, filename)) {
       clienterror(fd, method, "400", "Bad request",
@@ -166,90 +903,289 @@ void doit(int fd) {
       return;    
     }
 
-    if ((clientfd = Open_clientfd(host, port)) < 0)
+    // a seek into a large object: fetch just the chunks it needs
+    if (have_key && range.present && !range.suffix && chunk_size && !strcasecmp(method, "GET")
+        && serve_chunked_range(fd, key, host, port, filename, buf, &range))
+      return;
+    // otherwise fetch the whole object so it can be cached, and slice it here
+    if (range.present) {
+      strip_header(buf, "Range:");
+      strip_header(buf, "If-Range:");
+    }
+
+    fetch_start = now_ms();
+    if ((clientfd = open_origin(host, port)) < 0) {
+      clienterror(fd, host, "502", "Bad gateway", "Could not connect to the origin");
       return;
+    }
     forward_request(clientfd, method, filename, host, port, buf);
+    trace_mark(T_SENT);
     /* end of request to server */
 
     /* redirect response to client */
     Rio_readinitb(&rio, clientfd);  // 새로운 rio (clientfd).
-    serve_fresh_response(&rio, fd, uri);
-    Close(clientfd);
+    serve_fresh_response(&rio, fd, have_key ? key : NULL, fetch_start, &range, buf);
+    close_origin(clientfd);
+    my_access.upstream_ms = now_ms() - fetch_start;
    /* end of redirect response to client */
   }
   /* end of make response */
 }
 
+/* Lock-free lookup. Caller is inside an epoch or holds cache_mutex. */
 cache_data *is_cached(char *uri) {
-  cache_data *node = nil->next;
-  while(node != nil && strcmp(uri, node->uri)) {
-    node = node->next;
+  cache_data *node = atomic_load_explicit(&cache_table[cache_hash(uri) & (CACHE_BUCKETS - 1)],
+                                          memory_order_acquire);
+  while(node && strcmp(uri, node->uri)) {
+    node = atomic_load_explicit(&node->hnext, memory_order_acquire);
+  }
+  return node ? node : nil;
+}
+
+/*
+ * cache_get - find uri and pin it. The epoch only covers the lookup itself;
+ *   the returned reference keeps the body alive for as long as the caller
+ *   needs to send it, without holding any lock. Returns nil on a miss.
+ */
+cache_data *cache_get(char *uri) {
+  cache_data *node;
+  int ref;
+
+  epoch_enter();
+  node = is_cached(uri);
+  if (node != nil && cache_expired(node))
+    node = nil;   // stale: refetch, do_cache replaces it
+  if (node != nil) {
+    ref = atomic_load_explicit(&node->refcnt, memory_order_relaxed);
+    do {
+      if (ref == 0) {   // lost the race with the last release
+        node = nil;
+        break;
+      }
+    } while (!atomic_compare_exchange_weak_explicit(&node->refcnt, &ref, ref + 1,
+                                                    memory_order_acquire, memory_order_relaxed));
   }
+  epoch_exit();
   return node;
 }
 
-void serve_fresh_response(rio_t *rp, int connfd, char *uri)
+/* Drop a reference taken by cache_get (or the cache's own, on eviction). */
+void cache_put(cache_data *node) {
+  if (atomic_fetch_sub_explicit(&node->refcnt, 1, memory_order_acq_rel) == 1) {
+    if (!node->mapped) {
+      free(node->src);
+      free(node->hdrs);
+    }
+    free(node->gz);
+    free(node->gz_hdrs);
+    node->src = NULL;
+    epoch_retire(node);  // other readers may still be looking at the node itself
+  }
+}
+
+void serve_fresh_response(rio_t *rp, int connfd, char *key, double fetch_start, range_t *range,
+                          char *req_headers)
 {                      // rio has clientfd.
-  char *srcp; // source pointer
-  size_t src_size = 0;
-  char buf[MAXLINE];
+  char *srcp, *uri = key; // source pointer, key the object is stored under
+  char vary[MAXLINE], variant[MAX_KEY_LEN];
+  size_t src_size = 0, hdrs_size = 0, from = 0, to = (size_t)-1, total;
+  int status = 0, has_length = 0, cacheable, storable = 1, overflow = 0, encode = 0;
+  time_t expires = 0;
+  char buf[MAXLINE], hdrs[MAXBUF];
+  ssize_t n;
+  disk_writer w;
+
+  log_msg(LOG_DEBUG, "<<<<<<<< Response headers from server\n");
+  // read reponse line & headers. They are held back (and kept for the cache)
+  // so that a Range request can still be answered with a 206.
+  if ((n = io_readlineb(rp, buf, MAXLINE)) <= 0) {
+    if (origin_timer.fired)
+      clienterror(connfd, "", "504", "Gateway Timeout", "The origin did not respond in time");
+    return;
+  }
+  trace_mark(T_STATUS);
+  sscanf(buf, "%*s %d", &status);
+  my_access.status = status;   // send_head turns it into a 206/416 for a Range
+  while (1) {
+    log_msg(LOG_DEBUG, "%s", buf);
+    if (!strncasecmp(buf, "Content-Length:", 15)) {
+      src_size = atol(buf + 15);
+      has_length = 1;
+    }
+    if (!strncasecmp(buf, "Cache-Control:", 14))
+      expires = parse_freshness(buf + 14, &storable);
+    if (!overflow && hdrs_size + n > MAXBUF) {  // too long to keep: pass through untouched
+      overflow = 1;
+      note_head(status);
+      io_writen(connfd, hdrs, hdrs_size);
+    }
+    if (overflow)
+      io_writen(connfd, buf, n);
+    else {
+      memcpy(hdrs + hdrs_size, buf, n);
+      hdrs_size += n;
+    }
+    if (!strcmp(buf, "\r\n"))  // end of headers
+      break;
+    if ((n = io_readlineb(rp, buf, MAXLINE)) <= 0) {
+      if (!overflow) {
+        note_head(status);
+        io_writen(connfd, hdrs, hdrs_size);
+      }
+      return;
+    }
+  }
+  cacheable = key && status == 200 && has_length && storable && !overflow;
 
-  printf("<<<<<<<< Response headers from server\n");
-  // read & make reponse line
-  Rio_readlineb(rp, buf, MAXLINE);
-  Rio_writen(connfd, buf, strlen(buf));
-    printf("%s", buf);
+  // a response that varies is stored under the variant for this request
+  if (cacheable && header_value(hdrs, hdrs_size, "Vary:", vary, sizeof(vary))) {
+    if (strchr(vary, '*') || !vary_key(key, vary, req_headers, variant))
+      cacheable = 0;
+    else {
+      vary_remember(key, vary);
+      cache_remove(key);   // an older copy without Vary must not be served to everyone
+      disk_remove(key);
+      uri = variant;
+    }
+  }
+
+  // a text object that will get a gzip variant: say so in both variants' headers
+  if (cacheable && src_size <= MAX_OBJECT_SIZE && compressible(hdrs, hdrs_size, src_size)
+      && hdrs_size + 32 <= MAXBUF) {
+    hdrs_size -= 2;   // reopen the header block before its blank line
+    hdrs_size += sprintf(hdrs + hdrs_size, "Vary: Accept-Encoding\r\n\r\n");
+    encode = 1;
+  }
 
-  // read & make respone headers
-  while(strcmp(buf, "\r\n")) {  // 0이 아닌 값(true)이 나올 때. 즉, readline했을 때 값이 "\r\n"가 아닐 때.
-    Rio_readlineb(rp, buf, MAXLINE);
-    if (strstr(buf, "Content-Length")){
-      src_size = atoi(rindex(buf, ':')+2);
+  if (!overflow) {
+    if (status == 200 && has_length)
+      send_head(connfd, hdrs, hdrs_size, src_size, range, &from, &to);
+    else {
+      note_head(status);
+      io_writen(connfd, hdrs, hdrs_size);
+      if (has_length)
+        to = src_size;
     }
-    Rio_writen(connfd, buf, strlen(buf));
-    printf("%s", buf);
   }
 
-  // if body exists, read & make response body
-  if (src_size) {
+  // small objects: read whole, then offer to the RAM cache
+  if (cacheable && src_size <= MAX_OBJECT_SIZE) {
     srcp = malloc(src_size);
-    Rio_readnb(rp, srcp, src_size);
+    total = (n = io_readnb(rp, srcp, src_size)) > 0 ? n : 0;
+    trace_mark(T_FETCHED);
 
-    if (src_size <= MAX_OBJECT_SIZE) {
-      do_cache(srcp, src_size, uri);
-      Rio_writen(connfd, srcp, src_size);
-    }
-    else {
-      Rio_writen(connfd, srcp, src_size);
+    // send before admitting: once cached, the body belongs to the cache
+    if (total < to)
+      to = total;   // the origin stopped short
+    if (to > from)
+      io_writen(connfd, srcp + from, to - from);
+    if (total != src_size
+        || !do_cache(srcp, src_size, hdrs, hdrs_size, uri, now_ms() - fetch_start, expires, encode))
       free(srcp);
-    }
-    printf("--- %d bytes of contents is sent to client. ---\n\n", src_size);
   }
+  // large objects: stream through, spooling to the disk tier if it is on
+  else if (cacheable && disk_begin(&w, uri, hdrs, hdrs_size, src_size, now_ms() - fetch_start, expires)) {
+    if ((total = relay_body(rp, connfd, src_size, &w, from, to)) == src_size)
+      w.cost = now_ms() - fetch_start;
+    else
+      w.failed = 1;
+    disk_commit(&w);
+  }
+  else
+    total = relay_body(rp, connfd, has_length ? (ssize_t)src_size : -1, NULL, from, to);
+  trace_mark(T_FETCHED);
+  my_access.origin_bytes += total;
+  if (total < to)
+    to = total;
+  src_size = to > from ? to - from : 0;
+  cache_stats.bytes_served += src_size;
+  my_access.bytes += src_size;
+  trace_mark(T_BODY);
+  log_msg(LOG_DEBUG, "--- %zu bytes of contents is sent to client. ---\n\n", src_size);
 }
 
-void serve_cached_response(int fd, cache_data *node) {
-  char buf[MAXLINE];
-  /* response headers */
-  // make request line
-  sprintf(buf, "HTTP/1.0 200 OK\r\n");
-  // make request headers
-  sprintf(buf, "%sConnection: close\r\n", buf);
-  // sprintf(buf, "%sContent-Length: %d\r\n", buf, size);
-  // sprintf(buf, "%sContent-Type: %s\r\n\r\n", buf, filetype);    // use of filetype
-  sprintf(buf, "%s\r\n", buf);
+/* Parse a Cache-Control value: returns the expiry time for max-age (0 if
+   none) and clears *cacheable for directives that forbid shared caching. */
+time_t parse_freshness(char *value, int *cacheable) {
+  char *p;
 
-  // send
-  Rio_writen(fd, buf, strlen(buf));
-    printf("Response headers:\n");
-    printf("%s", buf);
+  if (find_token(value, "no-store") || find_token(value, "no-cache") || find_token(value, "private"))
+    *cacheable = 0;
+  if ((p = find_token(value, "s-maxage=")) != NULL || (p = find_token(value, "max-age=")) != NULL) {
+    p = strchr(p, '=') + 1;
+    if (atol(p) <= 0)
+      *cacheable = 0;
+    return time(NULL) + atol(p);
+  }
+  return 0;
+}
 
-  /* response body */
-  Rio_writen(fd, node->src, node->body_size);
-  printf("--- %d bytes of cached contents is sent to client. ---\n\n", node->body_size);
+/* Case-insensitive strstr */
+char *find_token(char *s, char *token) {
+  size_t n = strlen(token);
 
-  /* make this node fresh */
-  delete_cache_node(node);
-  push_cache_node(node);
+  for (; *s; s++)
+    if (!strncasecmp(s, token, n))
+      return s;
+  return NULL;
+}
+
+/* Copy len body bytes (or everything up to EOF if len < 0) from the origin,
+   passing bytes [from, to) of it to the client and teeing all of it into w
+   if given. Returns the number of bytes read from the origin. */
+size_t relay_body(rio_t *rp, int connfd, ssize_t len, disk_writer *w, size_t from, size_t to) {
+  char buf[MAXBUF];
+  size_t total = 0, a, b;
+  ssize_t n;
+
+  while (len < 0 || total < (size_t)len) {
+    n = (len < 0 || len - total > MAXBUF) ? MAXBUF : len - total;
+    if ((n = io_readnb(rp, buf, n)) <= 0)
+      break;
+    timer_touch(&origin_timer);
+    timer_touch(&client_timer);   // progress, even if none of it is for the client
+    a = from > total ? from - total : 0;
+    b = to < total + n ? (to > total ? to - total : 0) : (size_t)n;
+    if (b > a && io_writen(connfd, buf + a, b - a) < 0)
+      break;   // the client left: stop fetching for it
+    if (w)
+      disk_write(w, buf, n);
+    total += n;
+  }
+  return total;
+}
+
+void serve_cached_response(int fd, cache_data *node, range_t *range, int gzip) {
+  size_t from, to;
+
+  // the gzip variant, to a client that takes it; a Range always gets the identity body
+  if (gzip && node->gz && !range->present) {
+    io_writen(fd, node->gz_hdrs, node->gz_hdrs_size);
+    note_head(200);
+    io_writen(fd, node->gz, node->gz_size);
+    from = 0;
+    to = node->gz_size;
+    cache_stats.gzip_hits++;
+    cache_stats.gzip_saved += node->body_size - node->gz_size;
+  }
+  else {
+    /* response headers, as the origin sent them (or a 206 for a Range) */
+    send_head(fd, node->hdrs, node->hdrs_size, node->body_size, range, &from, &to);
+
+    /* response body */
+    io_writen(fd, (char *)node->src + from, to - from);
+  }
+  trace_mark(T_BODY);
+  log_msg(LOG_DEBUG, "--- %zu bytes of cached contents is sent to client. ---\n\n", to - from);
+
+  /* make this node fresh: the priority is recomputed lazily by the next eviction */
+  cache_stats.hits++;
+  cache_stats.bytes_served += to - from;
+  cache_stats.bytes_hit += to - from;
+  my_access.bytes += to - from;
+  atomic_fetch_add_explicit(&node->freq, 1, memory_order_relaxed);
+  if (!atomic_load_explicit(&node->referenced, memory_order_relaxed))
+    atomic_store_explicit(&node->referenced, 1, memory_order_relaxed);
 }
 
 void push_cache_node(cache_data *node) {
@@ -266,26 +1202,2146 @@ void delete_cache_node(cache_data *node) {
   node->next->prev = node->prev;
 }
 
-void do_cache(void *srcp, size_t src_size, char *uri) {
-                          // rio has clientfd.
+/*
+ * do_cache - GDSF admission and eviction. An object is admitted only if every
+ *   victim needed to make room has a lower priority (value per byte) than the
+ *   newcomer, so one large cold object cannot flush many small hot ones.
+ *   Returns 1 if the cache took ownership of srcp, 0 if it was rejected.
+ */
+int do_cache(void *srcp, size_t src_size, char *hdrs, size_t hdrs_size, char *uri, double cost,
+             time_t expires, int encode) {
+  cache_data *node, *victim, *oldest_node, *evicted = NULL, *stale = nil;
+  size_t freed, size, gz_size = 0, gz_hdrs_size = 0;
+  void *gz = NULL;
+  char *gz_hdrs = NULL;
+  unsigned freq;
+  double priority;
+
+  if (strlen(uri) >= MAX_KEY_LEN)
+    return 0;
+  if (cost < 1)   // sub-millisecond fetches are all equally cheap
+    cost = 1;
+  // compress once, here, outside the lock; the variant is charged with the body
+  if (encode && (gz_size = gzip_body(srcp, src_size, &gz)) > 0) {
+    gz_hdrs = Malloc(hdrs_size + 96);
+    gz_hdrs_size = gzip_headers(hdrs, hdrs_size, gz_size, gz_hdrs);
+  }
+  size = src_size + gz_size;
+
+  pthread_mutex_lock(&cache_mutex);
+  if ((stale = is_cached(uri)) != nil) {
+    if (!cache_expired(stale)) {  // another thread fetched it meanwhile
+      pthread_mutex_unlock(&cache_mutex);
+      free(gz);
+      free(gz_hdrs);
+      return 0;
+    }
+    cache_unlink(stale);   // replaced by this fresher copy
+    total_cache_size -= stale->size;
+  }
+  freq = sketch_estimate(uri);
+  priority = gdsf_priority(freq, cost, size);
+
+  /* CLOCK sweep: objects hit since the last sweep get their priority refreshed
+     against the current clock, exactly as an eager GDSF update would have */
+  for (node = nil->next; node != nil; node = node->next) {
+    if (atomic_exchange_explicit(&node->referenced, 0, memory_order_relaxed))
+      node->priority = gdsf_priority(node->freq, node->cost, node->size);
+    node->victim = 0;
+  }
+
+  /* admission: pick victims lowest priority first, without removing them yet */
+  freed = 0;
+  while (total_cache_size - freed + size > MAX_CACHE_SIZE) {
+    victim = nil;
+    for (node = nil->prev; node != nil; node = node->prev)  // oldest first breaks ties LRU
+      if (!node->victim && (victim == nil || node->priority < victim->priority))
+        victim = node;
+    if (victim == nil || victim->priority > priority)
+      break;
+    victim->victim = 1;
+    freed += victim->size;
+  }
+  if (total_cache_size - freed + size > MAX_CACHE_SIZE) {
+    cache_stats.rejected++;
+    pthread_mutex_unlock(&cache_mutex);
+    if (stale != nil)
+      cache_put(stale);   // expired and already unlinked: drop it all the same
+    free(gz);
+    free(gz_hdrs);
+    return 0;
+  }
+
+  /* evict the chosen victims */
+  node = nil->next;
+  while (node != nil) {
+    oldest_node = node;
+    node = node->next;
+    if (!oldest_node->victim)
+      continue;
+    cache_unlink(oldest_node);
+    total_cache_size -= oldest_node->size;
+    if (oldest_node->priority > cache_clock)
+      cache_clock = oldest_node->priority;   // age everything still cached
+    cache_stats.evictions++;
+    oldest_node->next = evicted;  // demoted to disk once the lock is dropped
+    evicted = oldest_node;
+  }
+  epoch_reclaim();
+
   /* make cache node */
-  cache_data *node = (cache_data *)malloc(sizeof(cache_data));
+  node = (cache_data *)malloc(sizeof(cache_data));
   node->body_size = src_size;
   strcpy(node->uri, uri);
   node->src = srcp;
+  node->hdrs = (char *)Malloc(hdrs_size);
+  memcpy(node->hdrs, hdrs, hdrs_size);
+  node->hdrs_size = hdrs_size;
+  node->size = size;
+  node->gz = gz;
+  node->gz_size = gz_size;
+  node->gz_hdrs = gz_hdrs;
+  node->gz_hdrs_size = gz_hdrs_size;
+  node->mapped = 0;
+  node->cost = cost;
+  node->freq = freq;
+  node->priority = priority;
+  node->stored_at = time(NULL);
+  node->expires = expires;
+  cache_insert(node);
+  cache_stats.admitted++;
+  pthread_mutex_unlock(&cache_mutex);
+
+  if (stale != nil)
+    cache_put(stale);
+
+  /* RAM evictions fall through to the disk tier */
+  while ((oldest_node = evicted) != NULL) {
+    evicted = evicted->next;
+    disk_demote(oldest_node);
+    cache_put(oldest_node);  // freed now, or by the last sender still writing it
+  }
+  return 1;
+}
+
+/* Drop the object stored under key, if any. */
+void cache_remove(char *key) {
+  cache_data *node;
 
-  /* insert to cache node list */
-  cache_data *oldest_node;
-  while (total_cache_size + node->body_size > MAX_CACHE_SIZE) {  // 캐시 공간이 충분할 때 까지 가장 오래된 노드 지운다.
-    // 맨 끝 노드를 지운다.
-    oldest_node = nil->prev;
-    delete_cache_node(oldest_node);
-    total_cache_size -= oldest_node->body_size;
-    free(oldest_node->src);
-    free(oldest_node);
+  pthread_mutex_lock(&cache_mutex);
+  if ((node = is_cached(key)) != nil) {
+    cache_unlink(node);
+    total_cache_size -= node->size;
   }
+  pthread_mutex_unlock(&cache_mutex);
+  if (node != nil)
+    cache_put(node);
+}
+
+/* Link a fully built node into the ring and publish it to readers.
+   Caller holds cache_mutex (or runs before any other thread exists). */
+void cache_insert(cache_data *node) {
+  _Atomic(cache_data *) *bucket = &cache_table[cache_hash(node->uri) & (CACHE_BUCKETS - 1)];
+
+  node->victim = 0;
+  atomic_init(&node->referenced, 0);
+  atomic_init(&node->refcnt, 1);
   push_cache_node(node);
-  total_cache_size += src_size;
+  atomic_init(&node->hnext, atomic_load_explicit(bucket, memory_order_relaxed));
+  atomic_store_explicit(bucket, node, memory_order_release);
+  total_cache_size += node->size;
+}
+
+int cache_expired(cache_data *node) {
+  return node->expires && node->expires <= time(NULL);
+}
+
+/* Greedy-Dual-Size-Frequency priority. Caller holds cache_mutex. */
+double gdsf_priority(unsigned freq, double cost, size_t size) {
+  return cache_clock + (double)freq * cost / (size ? size : 1);
+}
+
+/* Remove node from the ring and its bucket chain. Caller holds cache_mutex.
+   node->hnext is left intact so readers standing on it can keep walking. */
+void cache_unlink(cache_data *node) {
+  _Atomic(cache_data *) *link = &cache_table[cache_hash(node->uri) & (CACHE_BUCKETS - 1)];
+  cache_data *cur;
+
+  delete_cache_node(node);
+  while ((cur = atomic_load_explicit(link, memory_order_relaxed)) != node)
+    link = &cur->hnext;
+  atomic_store_explicit(link, atomic_load_explicit(&node->hnext, memory_order_relaxed),
+                        memory_order_release);
+}
+
+unsigned long cache_hash(char *uri) {
+  unsigned long h = 5381;
+  unsigned char *c;
+
+  for (c = (unsigned char *)uri; *c; c++)
+    h = h * 33 + *c;
+  return h;
+}
+
+static unsigned long sketch_slot(char *uri) {
+  return cache_hash(uri) % FREQ_SKETCH_SIZE;
+}
+
+/* Count one access to uri in the frequency sketch and return the estimate.
+   Caller holds cache_mutex. */
+unsigned sketch_touch(char *uri) {
+  unsigned long h = sketch_slot(uri);
+  int i;
+
+  if (freq_sketch[h] < 255)
+    freq_sketch[h]++;
+  if (++freq_sketch_count >= FREQ_SKETCH_SAMPLE) {
+    for (i = 0; i < FREQ_SKETCH_SIZE; i++)
+      freq_sketch[i] >>= 1;
+    freq_sketch_count = 0;
+  }
+  return freq_sketch[h] ? freq_sketch[h] : 1;
+}
+
+/* Caller holds cache_mutex. */
+unsigned sketch_estimate(char *uri) {
+  unsigned long h = sketch_slot(uri);
+  return freq_sketch[h] ? freq_sketch[h] : 1;
+}
+
+/* Caller holds cache_mutex. */
+void print_cache_stats(void) {
+  cache_stats_t *s = &cache_stats;
+
+  log_msg(LOG_DEBUG, "<CACHE STATS> requests %lu, object hit ratio %.2f%% (%lu hits), "
+          "byte hit ratio %.2f%% (%lu / %lu bytes)\n",
+          s->requests, s->requests ? 100.0 * s->hits / s->requests : 0.0, s->hits,
+          s->bytes_served ? 100.0 * s->bytes_hit / s->bytes_served : 0.0,
+          s->bytes_hit, s->bytes_served);
+  log_msg(LOG_DEBUG, "              admitted %lu, rejected %lu, evicted %lu, clock %.4f\n",
+          s->admitted, s->rejected, s->evictions, cache_clock);
+  if (disk_dir)
+    log_msg(LOG_DEBUG, "              disk hits %lu, demoted to disk %lu\n", s->disk_hits, s->demotions);
+}
+
+/*
+ * Disk tier. Objects are appended to fixed-size segment files as one
+ * contiguous record (response headers followed by the body), so a hit is a
+ * single sendfile() of [offset, offset + hdrs_size + body_size). Segments are
+ * recycled oldest first; the index lives only in memory. A segment that
+ * cannot be opened (EMFILE, ENOSPC, EACCES) only means the object at hand
+ * is not stored.
+ */
+static disk_segment *disk_open_segment(void) {
+  disk_segment *seg;
+  char path[MAXLINE];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/seg-%06d", disk_dir, disk_next_id);
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+    atomic_fetch_add(&io_errors, 1);
+    log_msg(LOG_INFO, "@ disk tier: cannot open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  seg = (disk_segment *)Malloc(sizeof(disk_segment));
+  seg->id = disk_next_id++;
+  seg->fd = fd;
+  seg->used = 0;
+  seg->entries = NULL;
+  seg->next = NULL;
+  atomic_init(&seg->refcnt, 1);
+  return seg;
+}
+
+static void disk_segment_put(disk_segment *seg) {
+  if (atomic_fetch_sub(&seg->refcnt, 1) == 1) {
+    close(seg->fd);
+    free(seg);
+  }
+}
+
+/* Unlink an index entry from its bucket and stop counting it; its bytes stay
+   in the segment until that is recycled. Caller holds disk_mutex. */
+static void disk_index_remove(disk_entry *entry) {
+  disk_entry **link = &disk_table[cache_hash(entry->uri) & (DISK_BUCKETS - 1)];
+
+  while (*link != entry)
+    link = &(*link)->hnext;
+  *link = entry->hnext;
+  entry->dead = 1;
+  disk_objects--;
+  disk_bytes -= entry->hdrs_size + entry->body_size;
+}
+
+/* Drop the oldest segment and every object in it. Caller holds disk_mutex. */
+static void disk_drop_oldest(void) {
+  disk_segment *seg = disk_oldest;
+  disk_entry *entry, *next;
+  char path[MAXLINE];
+
+  disk_oldest = seg->next;
+  disk_nsegments--;
+  for (entry = seg->entries; entry; entry = next) {
+    next = entry->snext;
+    if (!entry->dead)
+      disk_index_remove(entry);
+    free(entry);
+  }
+  snprintf(path, sizeof(path), "%s/seg-%06d", disk_dir, seg->id);
+  unlink(path);
+  disk_segment_put(seg);   // senders still holding it keep the fd open
+}
+
+/* Create the cache directory and clear segments left by a previous run. */
+void disk_init(char *dir, size_t capacity_mb) {
+  DIR *d;
+  struct dirent *de;
+  char path[MAXLINE];
+
+  disk_dir = dir;
+  disk_max_segments = ((size_t)capacity_mb << 20) / DISK_SEGMENT_SIZE;
+  if (disk_max_segments < 2)
+    disk_max_segments = 2;
+  mkdir(dir, 0700);
+  if ((d = opendir(dir)) == NULL) {
+    fprintf(stderr, "disk tier off: cannot open %s: %s\n", dir, strerror(errno));
+    disk_dir = NULL;
+    return;
+  }
+  while ((de = readdir(d)) != NULL)
+    if (!strncmp(de->d_name, "seg-", 4)) {
+      snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+      unlink(path);
+    }
+  closedir(d);
+  if ((disk_current = disk_oldest = disk_open_segment()) == NULL) {
+    fprintf(stderr, "disk tier off: cannot create segments in %s\n", dir);
+    disk_dir = NULL;
+    return;
+  }
+  disk_nsegments = 1;
+}
+
+/*
+ * disk_begin - reserve room for a record and write its headers. The body is
+ *   streamed in with disk_write and becomes visible at disk_commit. Returns 0
+ *   if the disk tier is off, the object cannot fit in a segment, or a new
+ *   segment cannot be opened; the object is then served uncached.
+ */
+int disk_begin(disk_writer *w, char *uri, char *hdrs, size_t hdrs_size, size_t body_size, double cost,
+               time_t expires) {
+  size_t need = hdrs_size + body_size;
+  disk_segment *seg;
+
+  if (!disk_dir || need > DISK_SEGMENT_SIZE || strlen(uri) >= MAX_KEY_LEN)
+    return 0;
+  pthread_mutex_lock(&disk_mutex);
+  if (disk_current->used + need > DISK_SEGMENT_SIZE) {
+    if ((seg = disk_open_segment()) == NULL) {
+      pthread_mutex_unlock(&disk_mutex);
+      return 0;
+    }
+    disk_current->next = seg;
+    disk_current = seg;
+    if (++disk_nsegments > disk_max_segments)
+      disk_drop_oldest();
+  }
+  w->seg = disk_current;
+  atomic_fetch_add(&w->seg->refcnt, 1);
+  w->offset = w->pos = disk_current->used;
+  disk_current->used += need;
+  pthread_mutex_unlock(&disk_mutex);
+
+  strcpy(w->uri, uri);
+  w->hdrs_size = hdrs_size;
+  w->body_size = body_size;
+  w->cost = cost;
+  w->expires = expires;
+  w->failed = 0;
+  disk_write(w, hdrs, hdrs_size);
+  return 1;
+}
+
+void disk_write(disk_writer *w, void *buf, size_t n) {
+  ssize_t rc;
+
+  while (n > 0 && !w->failed) {
+    if ((rc = pwrite(w->seg->fd, buf, n, w->pos)) < 0) {
+      if (errno == EINTR)
+        continue;
+      atomic_fetch_add(&io_errors, 1);   // not the client's: the object just isn't stored
+      w->failed = 1;
+      break;
+    }
+    buf = (char *)buf + rc;
+    n -= rc;
+    w->pos += rc;
+  }
+}
+
+/* Publish the record if it was written completely; the space is otherwise
+   simply wasted until the segment is recycled. */
+void disk_commit(disk_writer *w) {
+  disk_entry *entry, **link;
+
+  pthread_mutex_lock(&disk_mutex);
+  if (!w->failed && w->pos == w->offset + w->hdrs_size + w->body_size
+      && w->seg->id >= disk_oldest->id) {
+    /* replace any older copy */
+    for (link = &disk_table[cache_hash(w->uri) & (DISK_BUCKETS - 1)]; *link; link = &(*link)->hnext)
+      if (!strcmp((*link)->uri, w->uri)) {
+        disk_index_remove(*link);
+        break;
+      }
+    entry = (disk_entry *)Malloc(sizeof(disk_entry));
+    strcpy(entry->uri, w->uri);
+    entry->seg = w->seg;
+    entry->offset = w->offset;
+    entry->hdrs_size = w->hdrs_size;
+    entry->body_size = w->body_size;
+    entry->cost = w->cost;
+    entry->expires = w->expires;
+    entry->dead = 0;
+    entry->snext = w->seg->entries;
+    w->seg->entries = entry;
+    link = &disk_table[cache_hash(w->uri) & (DISK_BUCKETS - 1)];
+    entry->hnext = *link;
+    *link = entry;
+    disk_objects++;
+    disk_bytes += w->hdrs_size + w->body_size;
+  }
+  pthread_mutex_unlock(&disk_mutex);
+  disk_segment_put(w->seg);
+}
+
+/* Forget the disk copy stored under key, if any. */
+void disk_remove(char *key) {
+  disk_entry *entry;
+
+  if (!disk_dir)
+    return;
+  pthread_mutex_lock(&disk_mutex);
+  for (entry = disk_table[cache_hash(key) & (DISK_BUCKETS - 1)]; entry; entry = entry->hnext)
+    if (!strcmp(entry->uri, key)) {
+      disk_index_remove(entry);
+      break;
+    }
+  pthread_mutex_unlock(&disk_mutex);
+}
+
+/* Look uri up on disk and pin its segment. Returns 0 on a miss. */
+int disk_get(char *uri, disk_hit *hit) {
+  disk_entry *entry;
+
+  if (!disk_dir)
+    return 0;
+  pthread_mutex_lock(&disk_mutex);
+  for (entry = disk_table[cache_hash(uri) & (DISK_BUCKETS - 1)]; entry; entry = entry->hnext)
+    if (!strcmp(entry->uri, uri))
+      break;
+  if (entry && entry->expires && entry->expires <= time(NULL))
+    entry = NULL;
+  if (entry) {
+    hit->seg = entry->seg;
+    atomic_fetch_add(&hit->seg->refcnt, 1);
+    hit->offset = entry->offset;
+    hit->hdrs_size = entry->hdrs_size;
+    hit->body_size = entry->body_size;
+    hit->cost = entry->cost;
+    hit->expires = entry->expires;
+  }
+  pthread_mutex_unlock(&disk_mutex);
+  return entry != NULL;
+}
+
+/* Send a pinned disk object straight from the segment file to fd. */
+void serve_disk_response(int fd, disk_hit *hit, range_t *range) {
+  char hdrs[MAXBUF];
+  size_t from = 0, to = hit->body_size;
+
+  if (range && range->present && hit->hdrs_size <= MAXBUF
+      && pread(hit->seg->fd, hdrs, hit->hdrs_size, hit->offset) == (ssize_t)hit->hdrs_size) {
+    send_head(fd, hdrs, hit->hdrs_size, hit->body_size, range, &from, &to);
+    sendfile_all(fd, hit->seg->fd, hit->offset + hit->hdrs_size + from, to - from);
+  }
+  else {  // the common case, or a head we can't slice: one sendfile of the whole 200
+    note_head(200);
+    sendfile_all(fd, hit->seg->fd, hit->offset, hit->hdrs_size + hit->body_size);
+  }
+  trace_mark(T_BODY);
+  log_msg(LOG_DEBUG, "--- %zu bytes of disk cached contents is sent to client. ---\n\n", to - from);
+  cache_stats.hits++;
+  cache_stats.disk_hits++;
+  cache_stats.bytes_served += to - from;
+  cache_stats.bytes_hit += to - from;
+  my_access.bytes += to - from;
+}
+
+/* Copy an evicted RAM object to disk. Only the identity body goes: the gzip
+   variant lives in RAM only, so a promoted object is served uncompressed
+   until it is fetched again. */
+void disk_demote(cache_data *node) {
+  disk_writer w;
+
+  if (!disk_begin(&w, node->uri, node->hdrs, node->hdrs_size, node->body_size, node->cost, node->expires))
+    return;
+  disk_write(&w, node->src, node->body_size);
+  disk_commit(&w);
+  cache_stats.demotions++;
+}
+
+/* Pull a disk hit small enough for RAM back into the RAM tier, then unpin
+   its segment. */
+void disk_promote(disk_hit *hit, char *uri) {
+  char hdrs[MAXBUF], *body;
+
+  if (hit->body_size <= MAX_OBJECT_SIZE && hit->hdrs_size <= MAXBUF
+      && (body = malloc(hit->body_size)) != NULL) {
+    if (pread(hit->seg->fd, hdrs, hit->hdrs_size, hit->offset) != (ssize_t)hit->hdrs_size
+        || pread(hit->seg->fd, body, hit->body_size, hit->offset + hit->hdrs_size) != (ssize_t)hit->body_size
+        || !do_cache(body, hit->body_size, hdrs, hit->hdrs_size, uri, hit->cost, hit->expires, 0))
+      free(body);
+  }
+  disk_segment_put(hit->seg);
+}
+
+/*
+ * Cache snapshots. The file is a header followed by one 8-byte aligned
+ * record per RAM object (metadata, uri, headers, body). Loading maps the
+ * file and points the new nodes straight into the mapping, so a restarted
+ * proxy is hot without copying or refetching a single body.
+ */
+#define SNAP_MAGIC "PXYSNAP1"
+#define SNAP_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct snap_header {
+  char magic[8];
+  uint32_t count, pad;
+  double clock;
+  uint64_t size;          // whole file, for validation
+} snap_header;
+
+typedef struct snap_record {
+  uint32_t rec_size;      // header + uri + hdrs + body, aligned
+  uint32_t uri_len;       // including the NUL
+  uint32_t hdrs_size, body_size;
+  double cost;
+  uint32_t freq, pad;
+  int64_t stored_at, expires;
+} snap_record;
+
+/* Write the RAM tier to path (via a temporary file and rename, so a mapping
+   of the previous snapshot stays valid). The objects are pinned and their
+   metadata copied under cache_mutex; the writing happens after it is
+   dropped, so admissions don't wait on the disk. Returns the number of
+   objects. */
+int snapshot_save(char *path) {
+  char tmp[MAXLINE];
+  FILE *fp;
+  cache_data *node, **nodes;
+  snap_header h;
+  snap_record *r, *recs;
+  static const char zeros[8];
+  int count = 0, n = 0, i, err;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    fprintf(stderr, "snapshot: cannot create %s: %s\n", tmp, strerror(errno));
+    return -1;
+  }
+  memset(&h, 0, sizeof(h));
+  fwrite(&h, sizeof(h), 1, fp);   // rewritten once the totals are known
+
+  pthread_mutex_lock(&cache_mutex);
+  for (node = nil->next; node != nil; node = node->next)
+    n++;
+  nodes = (cache_data **)malloc((n + 1) * sizeof(cache_data *));
+  recs = (snap_record *)malloc((n + 1) * sizeof(snap_record));
+  if (nodes == NULL || recs == NULL) {   // keep the previous snapshot rather than an empty one
+    pthread_mutex_unlock(&cache_mutex);
+    fprintf(stderr, "snapshot: out of memory\n");
+    free(nodes);
+    free(recs);
+    fclose(fp);
+    unlink(tmp);
+    return -1;
+  }
+  for (node = nil->prev; node != nil; node = node->prev) {   // oldest first
+    if (cache_expired(node))
+      continue;
+    r = &recs[count];
+    memset(r, 0, sizeof(*r));
+    r->uri_len = strlen(node->uri) + 1;
+    r->hdrs_size = node->hdrs_size;
+    r->body_size = node->body_size;
+    r->rec_size = SNAP_ALIGN(sizeof(*r) + r->uri_len + r->hdrs_size + r->body_size);
+    r->cost = node->cost;
+    r->freq = node->freq;
+    r->stored_at = node->stored_at;
+    r->expires = node->expires;
+    atomic_fetch_add(&node->refcnt, 1);   // the cache's own reference keeps it above 0
+    nodes[count++] = node;
+  }
+  h.clock = cache_clock;
+  pthread_mutex_unlock(&cache_mutex);
+
+  for (i = 0; i < count; i++) {
+    r = &recs[i];
+    node = nodes[i];
+    fwrite(r, sizeof(*r), 1, fp);
+    fwrite(node->uri, 1, r->uri_len, fp);
+    fwrite(node->hdrs, 1, r->hdrs_size, fp);
+    fwrite(node->src, 1, r->body_size, fp);
+    fwrite(zeros, 1, r->rec_size - (sizeof(*r) + r->uri_len + r->hdrs_size + r->body_size), fp);
+    cache_put(node);
+  }
+  free(nodes);
+  free(recs);
+
+  memcpy(h.magic, SNAP_MAGIC, 8);
+  h.count = count;
+  h.size = ftell(fp);
+  rewind(fp);
+  fwrite(&h, sizeof(h), 1, fp);
+  err = ferror(fp);
+  if (fclose(fp) || err || rename(tmp, path) < 0) {
+    fprintf(stderr, "snapshot: cannot write %s\n", path);
+    unlink(tmp);
+    return -1;
+  }
+  return count;
+}
+
+/* Map a snapshot written by snapshot_save and install its objects. Called
+   before any connection thread exists. Returns the number of objects. */
+int snapshot_load(char *path) {
+  int fd, count = 0;
+  struct stat st;
+  char *base, *p, *end, *p2, vary[MAXLINE];
+  snap_header *h;
+  snap_record *r;
+  cache_data *node;
+  time_t now = time(NULL);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;   // first start
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snap_header)) {
+    close(fd);
+    return 0;
+  }
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return 0;
+  h = (snap_header *)base;
+  if (memcmp(h->magic, SNAP_MAGIC, 8) || h->size != (uint64_t)st.st_size) {
+    fprintf(stderr, "snapshot: ignoring invalid %s\n", path);
+    munmap(base, st.st_size);
+    return 0;
+  }
+  madvise(base, st.st_size, MADV_WILLNEED);
+  cache_clock = h->clock;
+
+  end = base + st.st_size;
+  for (p = base + sizeof(snap_header); p + sizeof(snap_record) <= end; p += r->rec_size) {
+    r = (snap_record *)p;
+    if (r->rec_size < sizeof(snap_record) || r->rec_size > end - p
+        || sizeof(snap_record) + (size_t)r->uri_len + r->hdrs_size + r->body_size > r->rec_size
+        || r->uri_len > sizeof(node->uri) || p[sizeof(snap_record) + r->uri_len - 1] != '\0')
+      break;   // truncated or corrupt: keep what we have
+    if ((r->expires && r->expires <= now) || total_cache_size + r->body_size > MAX_CACHE_SIZE)
+      continue;
+
+    node = (cache_data *)Malloc(sizeof(cache_data));
+    strcpy(node->uri, p + sizeof(snap_record));
+    node->hdrs = p + sizeof(snap_record) + r->uri_len;
+    node->hdrs_size = r->hdrs_size;
+    node->src = node->hdrs + r->hdrs_size;
+    node->body_size = r->body_size;
+    node->size = r->body_size;
+    node->gz = NULL;   // variants are not saved; the next admission rebuilds them
+    node->gz_hdrs = NULL;
+    node->mapped = 1;   // bodies live in the mapping, which is never unmapped
+    node->cost = r->cost;
+    node->freq = r->freq;
+    node->priority = gdsf_priority(r->freq, r->cost, r->body_size);
+    node->stored_at = r->stored_at;
+    node->expires = r->expires;
+    cache_insert(node);
+    if ((p2 = strstr(node->uri, "\nvary")) != NULL
+        && header_value(node->hdrs, node->hdrs_size, "Vary:", vary, sizeof(vary))) {
+      *p2 = '\0';   // the primary key is the part before the Vary values
+      vary_remember(node->uri, vary);
+      *p2 = '\n';
+    }
+    count++;
+  }
+  return count;
+}
+
+/* Signal thread: SIGUSR1 snapshots the cache, SIGTERM snapshots and exits. */
+void *snapshot_thread(void *vargp) {
+  sigset_t *mask = (sigset_t *)vargp;
+  double start;
+  int sig, n;
+
+  while (1) {
+    if (sigwait(mask, &sig))
+      continue;
+    start = now_ms();
+    n = snapshot_save(snapshot_path);
+    if (n >= 0)
+      log_msg(LOG_INFO, "@ Saved %d cached objects to %s in %.1f ms\n", n, snapshot_path, now_ms() - start);
+    if (sig == SIGTERM) {
+      log_flush();
+      exit(0);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Range support. A single "bytes=" range is answered with a 206 built from
+ * the stored origin headers; multi-range requests and ranges that fail an
+ * If-Range validator get the whole object, as RFC 7233 allows.
+ */
+/* Copy the value of header name (e.g. "ETag:") out of a header block that
+   need not be NUL-terminated. Returns 1 if found. */
+int header_value(char *hdrs, size_t size, char *name, char *out, size_t outsize) {
+  char *p = hdrs, *end = hdrs + size, *eol;
+  size_t n = strlen(name), len;
+
+  for (; p < end; p = eol + 1) {
+    if ((eol = memchr(p, '\n', end - p)) == NULL)
+      eol = end;
+    if ((size_t)(eol - p) > n && !strncasecmp(p, name, n)) {
+      p += n;
+      while (p < eol && (*p == ' ' || *p == '\t'))
+        p++;
+      len = eol - p;
+      while (len > 0 && (p[len - 1] == '\r' || p[len - 1] == ' '))
+        len--;
+      if (len >= outsize)
+        len = outsize - 1;
+      memcpy(out, p, len);
+      out[len] = '\0';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Remove every line of header name from a NUL-terminated header block. */
+void strip_header(char *headers, char *name) {
+  char *p = headers, *eol;
+  size_t n = strlen(name);
+
+  while (*p) {
+    eol = strchr(p, '\n');
+    eol = eol ? eol + 1 : p + strlen(p);
+    if (!strncasecmp(p, name, n))
+      memmove(p, eol, strlen(eol) + 1);
+    else
+      p = eol;
+  }
+}
+
+/* Pick Range and If-Range out of the client's headers. */
+void parse_range(char *headers, range_t *range) {
+  char value[MAXLINE], *dash;
+
+  memset(range, 0, sizeof(*range));
+  if (!header_value(headers, strlen(headers), "Range:", value, sizeof(value))
+      || strncasecmp(value, "bytes=", 6) || strchr(value, ',')
+      || (dash = strchr(value + 6, '-')) == NULL)
+    return;
+  if (dash == value + 6) {          // bytes=-N: the last N bytes
+    range->suffix = atol(dash + 1);
+    range->present = range->suffix > 0;
+  }
+  else {
+    range->first = atol(value + 6);
+    range->last = dash[1] ? atol(dash + 1) : -1;
+    range->present = range->first >= 0 && (range->last < 0 || range->last >= range->first);
+  }
+  header_value(headers, strlen(headers), "If-Range:", range->if_range, sizeof(range->if_range));
+}
+
+/* Does the range still apply to the object described by hdrs? */
+int range_applies(range_t *range, char *hdrs, size_t hdrs_size) {
+  char value[MAXLINE];
+
+  if (!range || !range->present)
+    return 0;
+  if (!range->if_range[0])
+    return 1;
+  if (range->if_range[0] == '"')    // strong entity tag
+    return header_value(hdrs, hdrs_size, "ETag:", value, sizeof(value)) && !strcmp(value, range->if_range);
+  if (!strncmp(range->if_range, "W/", 2))  // weak tags never validate a range
+    return 0;
+  return header_value(hdrs, hdrs_size, "Last-Modified:", value, sizeof(value))
+         && !strcmp(value, range->if_range);
+}
+
+/* Turn the range into [*from, *to) of a total-byte object. Returns 0 if it
+   is unsatisfiable. */
+int resolve_range(range_t *range, size_t total, size_t *from, size_t *to) {
+  if (range->suffix) {
+    if (total == 0)
+      return 0;
+    *from = total > (size_t)range->suffix ? total - range->suffix : 0;
+    *to = total;
+    return 1;
+  }
+  if ((size_t)range->first >= total)
+    return 0;
+  *from = range->first;
+  *to = (range->last < 0 || (size_t)range->last >= total) ? total : (size_t)range->last + 1;
+  return 1;
+}
+
+/* Send a 206 head: the origin headers minus status line and framing, plus
+   our own Content-Range and Content-Length. */
+void send_partial_headers(int fd, char *hdrs, size_t hdrs_size, size_t from, size_t to, size_t total) {
+  char buf[MAXBUF + MAXLINE], *p, *eol, *end = hdrs + hdrs_size;
+  size_t len;
+
+  len = sprintf(buf, "HTTP/1.0 206 Partial Content\r\n");
+  p = memchr(hdrs, '\n', hdrs_size);   // skip the status line
+  for (p = p ? p + 1 : end; p < end; p = eol) {
+    eol = memchr(p, '\n', end - p);
+    eol = eol ? eol + 1 : end;
+    if (!strncmp(p, "\r\n", 2) || !strncasecmp(p, "Content-Length:", 15)
+        || !strncasecmp(p, "Content-Range:", 14))
+      continue;
+    memcpy(buf + len, p, eol - p);
+    len += eol - p;
+  }
+  len += sprintf(buf + len, "Content-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\n\r\n",
+                 from, to - 1, total, to - from);
+  io_writen(fd, buf, len);
+  note_head(206);
+    log_msg(LOG_DEBUG, "Response headers:\n");
+    log_write(LOG_DEBUG, buf, len);
+}
+
+void send_unsatisfiable(int fd, size_t total) {
+  char buf[MAXLINE];
+
+  sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+               "Content-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n", total);
+  io_writen(fd, buf, strlen(buf));
+  note_head(416);
+}
+
+/* Write the head for a response body of total bytes and return the slice
+   [*from, *to) of it the client should get. */
+void send_head(int fd, char *hdrs, size_t hdrs_size, size_t total, range_t *range,
+               size_t *from, size_t *to) {
+  *from = 0;
+  *to = total;
+  if (!range_applies(range, hdrs, hdrs_size)) {
+    io_writen(fd, hdrs, hdrs_size);
+    note_head(200);
+      log_msg(LOG_DEBUG, "Response headers:\n");
+      log_write(LOG_DEBUG, hdrs, hdrs_size);
+  }
+  else if (resolve_range(range, total, from, to))
+    send_partial_headers(fd, hdrs, hdrs_size, *from, *to, total);
+  else {
+    send_unsatisfiable(fd, total);
+    *from = *to = 0;
+  }
+}
+
+void sendfile_all(int out_fd, int in_fd, off_t off, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = sendfile(out_fd, in_fd, &off, len)) <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        io_failed("sendfile");
+      break;   // client went away
+    }
+    len -= n;
+    if (out_fd == client_timer.fd)
+      timer_touch(&client_timer);
+  }
+}
+
+/*
+ * Chunked fetching (-C). A Range miss fetches only the fixed-size chunks that
+ * cover it, each cached as its own object under "<uri>#chunk=<n>" with the
+ * origin's 206 headers, so a seek into a large video costs one chunk.
+ */
+static void chunk_release(chunk_t *c);
+
+static void chunk_key(char *key, char *uri, size_t idx) {
+  snprintf(key, MAXLINE, "%s#chunk=%zu", uri, idx);
+}
+
+/* Find chunk idx in either tier, or fetch it with a Range request. */
+static int chunk_get(chunk_t *c, char *uri, size_t idx, char *host, char *port, char *filename,
+                     char *headers) {
+  char key[MAXLINE], buf[MAXLINE], req[MAXLINE], value[MAXLINE], *slash;
+  int clientfd, status = 0, storable = 1;
+  rio_t rio;
+  ssize_t n;
+  size_t len;
+  double fetch_start;
+
+  memset(c, 0, sizeof(*c));
+  c->node = nil;
+  chunk_key(key, uri, idx);
+  if ((c->node = cache_get(key)) != nil) {
+    c->hdrs_size = c->node->hdrs_size;
+    memcpy(c->hdrs, c->node->hdrs, c->hdrs_size);
+    c->size = c->node->body_size;
+  }
+  else if (disk_get(key, &c->hit)) {
+    c->on_disk = 1;
+    c->hdrs_size = c->hit.hdrs_size;
+    c->size = c->hit.body_size;
+    if (pread(c->hit.seg->fd, c->hdrs, c->hdrs_size, c->hit.offset) != (ssize_t)c->hdrs_size) {
+      disk_segment_put(c->hit.seg);
+      return 0;
+    }
+  }
+  else {
+    /* ask the origin for exactly this chunk */
+    snprintf(req, sizeof(req), "%s", headers);
+    strip_header(req, "Range:");
+    strip_header(req, "If-Range:");
+    len = strlen(req) - 2;   // drop the terminating blank line
+    if ((size_t)snprintf(req + len, sizeof(req) - len, "Range: bytes=%zu-%zu\r\n\r\n",
+                         idx * chunk_size, (idx + 1) * chunk_size - 1) >= sizeof(req) - len)
+      return 0;   // no room for our Range: caller does a full fetch
+    fetch_start = now_ms();
+    if ((clientfd = open_origin(host, port)) < 0)
+      return 0;
+    forward_request(clientfd, "GET", filename, host, port, req);
+    trace_mark(T_SENT);   // like the other stamps, only the first chunk's count
+
+    Rio_readinitb(&rio, clientfd);
+    while ((n = io_readlineb(&rio, buf, MAXLINE)) > 0) {
+      trace_mark(T_STATUS);
+      if (!c->hdrs_size)
+        sscanf(buf, "%*s %d", &status);
+      if (!strncasecmp(buf, "Content-Length:", 15))
+        c->size = atol(buf + 15);
+      if (!strncasecmp(buf, "Cache-Control:", 14))
+        c->expires = parse_freshness(buf + 14, &storable);
+      if (!strncasecmp(buf, "Vary:", 5))
+        storable = 0;   // chunks are keyed without variants
+      if (c->hdrs_size + n > MAXBUF)
+        break;
+      memcpy(c->hdrs + c->hdrs_size, buf, n);
+      c->hdrs_size += n;
+      if (!strcmp(buf, "\r\n"))
+        break;
+    }
+    if (status != 206 || strcmp(buf, "\r\n") || c->size == 0 || c->size > chunk_size
+        || (c->body = malloc(c->size)) == NULL) {
+      close_origin(clientfd);
+      return 0;   // origin ignores ranges (or is unhappy): caller does a full fetch
+    }
+    if ((size_t)io_readnb(&rio, c->body, c->size) != c->size) {
+      close_origin(clientfd);
+      free(c->body);
+      return 0;
+    }
+    close_origin(clientfd);
+    c->storable = storable;
+    c->cost = now_ms() - fetch_start;
+    my_access.origin_bytes += c->size;
+    my_access.upstream_ms = (my_access.upstream_ms < 0 ? 0 : my_access.upstream_ms) + c->cost;
+    strcpy(c->key, key);
+  }
+  if (!header_value(c->hdrs, c->hdrs_size, "Content-Range:", value, sizeof(value))
+      || (slash = strchr(value, '/')) == NULL || slash[1] == '*') {
+    c->storable = 0;
+    chunk_release(c);
+    return 0;
+  }
+  c->total = atol(slash + 1);
+  return 1;
+}
+
+/* Send bytes [a, b) of a chunk. */
+static void chunk_send(int fd, chunk_t *c, size_t a, size_t b) {
+  if (b <= a)
+    return;
+  if (c->body)
+    io_writen(fd, c->body + a, b - a);
+  else if (c->on_disk)
+    sendfile_all(fd, c->hit.seg->fd, c->hit.offset + c->hit.hdrs_size + a, b - a);
+  else
+    io_writen(fd, (char *)c->node->src + a, b - a);
+  cache_stats.bytes_served += b - a;
+  my_access.bytes += b - a;
+  if (!c->body)
+    cache_stats.bytes_hit += b - a;
+}
+
+/* Unpin a cached chunk, or hand a freshly fetched one to the cache. */
+static void chunk_release(chunk_t *c) {
+  disk_writer w;
+
+  if (c->node != nil)
+    cache_put(c->node);
+  else if (c->on_disk)
+    disk_segment_put(c->hit.seg);
+  else if (c->body) {
+    if (c->storable && c->size <= MAX_OBJECT_SIZE
+        && do_cache(c->body, c->size, c->hdrs, c->hdrs_size, c->key, c->cost, c->expires, 0))
+      return;   // the cache owns the body now
+    if (c->storable && disk_begin(&w, c->key, c->hdrs, c->hdrs_size, c->size, c->cost, c->expires)) {
+      disk_write(&w, c->body, c->size);
+      disk_commit(&w);
+    }
+    free(c->body);
+  }
+}
+
+/*
+ * serve_chunked_range - answer a Range miss from cached or freshly fetched
+ *   chunks. Returns 0 if nothing was sent because the origin does not do
+ *   ranges, so the caller falls back to fetching the whole object.
+ */
+int serve_chunked_range(int fd, char *uri, char *host, char *port, char *filename, char *headers,
+                        range_t *range) {
+  chunk_t c;
+  size_t idx, from, to, start, end;
+  int all_cached;
+
+  idx = range->first / chunk_size;
+  if (!chunk_get(&c, uri, idx, host, port, filename, headers))
+    return 0;
+  if (!range_applies(range, c.hdrs, c.hdrs_size)) {
+    chunk_release(&c);
+    return 0;
+  }
+  if (!resolve_range(range, c.total, &from, &to)) {
+    send_unsatisfiable(fd, c.total);
+    chunk_release(&c);
+    return 1;
+  }
+  send_partial_headers(fd, c.hdrs, c.hdrs_size, from, to, c.total);
+  all_cached = !c.body;
+  while (1) {
+    start = idx * chunk_size;
+    end = start + c.size;
+    chunk_send(fd, &c, (from > start ? from : start) - start, (to < end ? to : end) - start);
+    chunk_release(&c);
+    if (end >= to || ++idx * chunk_size >= to || my_access.io_error)
+      break;
+    if (!chunk_get(&c, uri, idx, host, port, filename, headers))
+      break;   // origin failed mid-range: the client sees a short body
+    all_cached &= !c.body;
+  }
+  if (all_cached) {
+    cache_stats.hits++;
+    my_access.cache = "hit";
+  }
+  trace_mark(T_BODY);
+  log_msg(LOG_DEBUG, "--- bytes %zu-%zu of %s sent in chunks of %zu. ---\n\n", from, to - 1, uri, chunk_size);
+  return 1;
+}
+
+/*
+ * Cache keys. Equivalent spellings of a URI share one key, and responses
+ * carrying Vary are stored under a secondary key that appends the request
+ * header values they vary on. The Vary list itself is remembered per
+ * primary key in a small direct-mapped table, consulted only when the
+ * primary lookup misses, so non-varying hits stay lock-free.
+ */
+static int is_unreserved(int c) {
+  return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+static int hexval(int c) {
+  return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/*
+ * cache_key - canonical form of an absolute URI: lowercase scheme and host,
+ *   default port dropped, %XX escapes of unreserved characters decoded and
+ *   the remaining escapes upper-cased, fragment removed, empty path -> "/".
+ *   Returns 0 if the key does not fit in MAX_KEY_LEN.
+ */
+int cache_key(char *uri, char *key) {
+  char *out = key, *limit = key + MAX_KEY_LEN - 1;
+  char *p, *sep, *auth_end, *host, *port_sep, *c;
+  int scheme_len, c1;
+
+#define PUT(ch) do { if (out >= limit) return 0; *out++ = (ch); } while (0)
+  if ((sep = strstr(uri, "://")) == NULL) {   // not absolute: use as is
+    if (strlen(uri) >= MAX_KEY_LEN)
+      return 0;
+    strcpy(key, uri);
+    return 1;
+  }
+  for (p = uri; p < sep; p++)
+    PUT(tolower(*p));
+  scheme_len = sep - uri;
+  PUT(':'); PUT('/'); PUT('/');
+
+  /* authority: [userinfo@]host[:port] */
+  host = sep + 3;
+  auth_end = host + strcspn(host, "/?#");
+  for (c = host; c < auth_end; c++)
+    if (*c == '@')
+      host = c + 1;
+  port_sep = NULL;
+  for (c = (*host == '[') ? memchr(host, ']', auth_end - host) : host; c && c < auth_end; c++)
+    if (*c == ':')
+      port_sep = c;
+  for (c = host; c < (port_sep ? port_sep : auth_end); c++)
+    PUT(tolower(*c));
+  if (port_sep && port_sep + 1 < auth_end
+      && !(scheme_len == 4 && !strncasecmp(uri, "http", 4) && auth_end - port_sep == 3 && !strncmp(port_sep, ":80", 3))
+      && !(scheme_len == 5 && !strncasecmp(uri, "https", 5) && auth_end - port_sep == 4 && !strncmp(port_sep, ":443", 4)))
+    for (c = port_sep; c < auth_end; c++)
+      PUT(*c);
+
+  /* path and query */
+  p = auth_end;
+  if (*p != '/')
+    PUT('/');
+  while (*p && *p != '#') {
+    if (p[0] == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+      c1 = hexval(p[1]) * 16 + hexval(p[2]);
+      if (is_unreserved(c1))
+        PUT(c1);
+      else {
+        PUT('%'); PUT(toupper(p[1])); PUT(toupper(p[2]));
+      }
+      p += 3;
+    }
+    else
+      PUT(*p++);
+  }
+#undef PUT
+  *out = '\0';
+  return 1;
+}
+
+/* Secondary key for a response with "Vary: <vary>": the primary key plus the
+   request's value of each named header. Returns 0 if it does not fit. */
+int vary_key(char *key, char *vary, char *req_headers, char *out) {
+  char list[MAXLINE], name[MAXLINE], value[MAXLINE], *tok, *save, *v, *o;
+  size_t len;
+
+  len = snprintf(out, MAX_KEY_LEN, "%s\nvary", key);
+  strcpy(list, vary);
+  for (tok = strtok_r(list, ", \t", &save); tok; tok = strtok_r(NULL, ", \t", &save)) {
+    snprintf(name, sizeof(name), "%s:", tok);
+    if (!header_value(req_headers, strlen(req_headers), name, value, sizeof(value)))
+      value[0] = '\0';
+    for (v = o = value; *v; v++)     // whitespace is not significant
+      if (*v != ' ' && *v != '\t')
+        *o++ = *v;
+    *o = '\0';
+    for (v = tok; *v; v++)
+      *v = tolower(*v);
+    len += snprintf(out + len, len < MAX_KEY_LEN ? MAX_KEY_LEN - len : 0, "\n%s=%s", tok, value);
+  }
+  return len < MAX_KEY_LEN;
+}
+
+static vary_slot *vary_find_slot(char *key) {
+  return &vary_table[cache_hash(key) & (VARY_SLOTS - 1)];
+}
+
+/* Remember that the object at key varies on the headers in vary. */
+void vary_remember(char *key, char *vary) {
+  vary_slot *slot = vary_find_slot(key);
+
+  if (strlen(vary) >= sizeof(slot->vary))
+    return;
+  pthread_mutex_lock(&vary_mutex);
+  strcpy(slot->key, key);   // a colliding key simply loses its entry
+  strcpy(slot->vary, vary);
+  pthread_mutex_unlock(&vary_mutex);
+}
+
+/* If the object at key is known to vary, build the secondary key for this
+   request into out. Returns 0 otherwise. */
+int vary_lookup(char *key, char *req_headers, char *out) {
+  vary_slot *slot = vary_find_slot(key);
+  char vary[sizeof(slot->vary)];
+  int found;
+
+  pthread_mutex_lock(&vary_mutex);
+  if ((found = !strcmp(slot->key, key)))
+    strcpy(vary, slot->vary);
+  pthread_mutex_unlock(&vary_mutex);
+  return found && vary_key(key, vary, req_headers, out);
+}
+
+/* Content types worth compressing; everything else is already dense. */
+static const char *gzip_types[] = {"text/html", "text/plain", "text/css", "application/javascript",
+                                   "application/json", NULL};
+
+/*
+ * compressible - whether a cacheable response should get a gzip variant:
+ *   compression is on (-z), the type is textual, and the origin neither
+ *   encoded it already nor made it Vary (the variant key would then have
+ *   to cover both).
+ */
+int compressible(char *hdrs, size_t hdrs_size, size_t body_size) {
+  char type[MAXLINE], value[MAXLINE];
+  int i;
+
+  if (!gzip_level || body_size < GZIP_MIN_SIZE
+      || !header_value(hdrs, hdrs_size, "Content-Type:", type, sizeof(type))
+      || header_value(hdrs, hdrs_size, "Content-Encoding:", value, sizeof(value))
+      || header_value(hdrs, hdrs_size, "Vary:", value, sizeof(value)))
+    return 0;
+  for (i = 0; gzip_types[i]; i++)
+    if (!strncasecmp(type, gzip_types[i], strlen(gzip_types[i])))
+      return 1;
+  return 0;
+}
+
+/* Does the client take gzip? "gzip;q=0" is a refusal. */
+int accepts_gzip(char *req_headers) {
+  char value[MAXLINE], *p;
+
+  if (!header_value(req_headers, strlen(req_headers), "Accept-Encoding:", value, sizeof(value))
+      || (p = find_token(value, "gzip")) == NULL)
+    return 0;
+  p += 4;
+  while (*p == ' ')
+    p++;
+  if (*p == ';' && (p = find_token(p, "q=")) != NULL && atof(p + 2) == 0)
+    return 0;
+  return 1;
+}
+
+/*
+ * gzip_body - compress size bytes of src into a new buffer at *out.
+ *   Returns the compressed size, or 0 (and no buffer) when compression
+ *   fails or does not make the body smaller.
+ */
+size_t gzip_body(void *src, size_t size, void **out) {
+  z_stream zs;
+  size_t n;
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)  // +16: gzip wrapper
+    return 0;
+  n = deflateBound(&zs, size);
+  *out = Malloc(n);
+  zs.next_in = src;
+  zs.avail_in = size;
+  zs.next_out = *out;
+  zs.avail_out = n;
+  n = deflate(&zs, Z_FINISH) == Z_STREAM_END ? zs.total_out : 0;
+  deflateEnd(&zs);
+  if (n == 0 || n >= size) {
+    free(*out);
+    *out = NULL;
+    return 0;
+  }
+  return n;
+}
+
+/*
+ * gzip_headers - the identity headers hdrs rewritten for a gzip body of
+ *   gz_size bytes, into out (at least hdrs_size + 96 bytes). A strong ETag
+ *   gets "-gz" inside its quotes, since the gzip bytes are a different
+ *   representation and must not validate as the identity one (If-Range,
+ *   If-None-Match); an ETag we can't rewrite is dropped. Returns the new
+ *   size.
+ */
+size_t gzip_headers(char *hdrs, size_t hdrs_size, size_t gz_size, char *out) {
+  char *p = hdrs, *end = hdrs + hdrs_size, *eol, *quote;
+  size_t len = 0;
+
+  for (; p < end; p = eol) {
+    eol = memchr(p, '\n', end - p);
+    eol = eol ? eol + 1 : end;
+    if (!strncmp(p, "\r\n", 2) || !strncasecmp(p, "Content-Length:", 15))
+      continue;   // the blank line is put back below
+    if (!strncasecmp(p, "ETag:", 5)) {
+      for (quote = eol - 1; quote > p && *quote != '"'; quote--)
+        ;
+      if (quote == p || memchr(p + 5, '"', quote - p - 5) == NULL)
+        continue;   // not a quoted tag
+      memcpy(out + len, p, quote - p);
+      len += quote - p;
+      memcpy(out + len, "-gz", 3);
+      len += 3;
+      p = quote;   // the closing quote and the rest of the line
+    }
+    memcpy(out + len, p, eol - p);
+    len += eol - p;
+  }
+  return len + sprintf(out + len, "Content-Length: %zu\r\nContent-Encoding: gzip\r\n\r\n", gz_size);
+}
+
+/* Identify a client by its address alone: every connection from it counts. */
+void client_key(struct sockaddr_storage *sa, client_id *id) {
+  memset(id, 0, sizeof(*id));
+  id->family = sa->ss_family;
+  if (sa->ss_family == AF_INET)
+    memcpy(id->addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+  else if (sa->ss_family == AF_INET6)
+    memcpy(id->addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+}
+
+static unsigned long limit_hash(client_id *id) {
+  unsigned long h = 5381;
+  int i;
+
+  for (i = 0; i < sizeof(id->addr); i++)
+    h = h * 33 + id->addr[i];
+  return (h ^ id->family) & (LIMIT_BUCKETS - 1);
+}
+
+/*
+ * limit_admit - account a new connection from id. Returns 0 if it may go
+ *   on (the caller then owes a limit_release), or the status to refuse it
+ *   with: 503 over the connection cap, 429 out of tokens. Each connection
+ *   carries one request, so a token is taken per connection.
+ */
+int limit_admit(client_id *id) {
+  unsigned long b = limit_hash(id);
+  pthread_mutex_t *lock = &limit_locks[b & (LIMIT_STRIPES - 1)];
+  limit_entry *e, **pp;
+  double now = now_ms(), full_ms = rate_limit > 0 ? rate_burst / rate_limit * 1000 : 0;
+  int status = 0;
+
+  pthread_mutex_lock(lock);
+  for (pp = &limit_table[b]; (e = *pp) != NULL; ) {
+    if (!memcmp(&e->id, id, sizeof(*id)))
+      break;
+    if (!e->conns && now - e->stamp >= full_ms) {   // idle and refilled: same as a new entry
+      *pp = e->next;
+      Free(e);
+    }
+    else
+      pp = &e->next;
+  }
+  if (!e) {
+    e = Malloc(sizeof(limit_entry));
+    e->id = *id;
+    e->conns = 0;
+    e->tokens = rate_burst;
+    e->stamp = now;
+    e->next = limit_table[b];
+    limit_table[b] = e;
+  }
+  if (rate_limit > 0) {
+    e->tokens += (now - e->stamp) * rate_limit / 1000;
+    if (e->tokens > rate_burst)
+      e->tokens = rate_burst;
+    e->stamp = now;
+  }
+  if (max_client_conns && e->conns >= max_client_conns)
+    status = 503;
+  else if (rate_limit > 0 && e->tokens < 1)
+    status = 429;
+  else {
+    e->conns++;
+    if (rate_limit > 0)
+      e->tokens -= 1;
+  }
+  pthread_mutex_unlock(lock);
+  return status;
+}
+
+/* A connection admitted by limit_admit is done. */
+void limit_release(client_id *id) {
+  unsigned long b = limit_hash(id);
+  pthread_mutex_t *lock = &limit_locks[b & (LIMIT_STRIPES - 1)];
+  limit_entry *e;
+
+  pthread_mutex_lock(lock);
+  for (e = limit_table[b]; e && memcmp(&e->id, id, sizeof(*id)); e = e->next)
+    ;
+  if (e)
+    e->conns--;
+  pthread_mutex_unlock(lock);
+}
+
+/* Refuse a connection from the accept loop. */
+void limit_reject(int fd, int status) {
+  atomic_fetch_add(status == 503 ? &limited_conns : &limited_requests, 1);
+  send_refusal(fd, status);
+  close(fd);
+}
+
+/*
+ * send_refusal - answer a connection with a bodiless 503 or 429 without
+ *   reading its request. The reply fits in any socket buffer, so this never
+ *   blocks, and a client that already left costs nothing but the error.
+ *   Whatever part of the request already arrived is discarded, so that
+ *   closing the socket does not reset it before the client reads the reply.
+ */
+void send_refusal(int fd, int status) {
+  static char busy[] = "HTTP/1.0 503 Service Unavailable\r\nRetry-After: 1\r\n"
+                       "Content-Length: 0\r\nConnection: close\r\n\r\n";
+  static char slow[] = "HTTP/1.0 429 Too Many Requests\r\nRetry-After: 1\r\n"
+                       "Content-Length: 0\r\nConnection: close\r\n\r\n";
+  char buf[MAXLINE];
+
+  if (status == 503)
+    send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+  else
+    send(fd, slow, sizeof(slow) - 1, MSG_NOSIGNAL);
+  note_head(status);
+  shutdown(fd, SHUT_WR);
+  while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+    ;
+}
+
+/*
+ * queued_ms - how long the data waiting on fd has been there, from the
+ *   kernel's receive timestamp (SO_TIMESTAMPNS). Returns -1 if nothing has
+ *   arrived yet or it carries no timestamp.
+ */
+double queued_ms(int fd) {
+  char byte, cbuf[CMSG_SPACE(sizeof(struct timespec))];
+  struct iovec iov = { &byte, 1 };
+  struct msghdr msg;
+  struct cmsghdr *c;
+  struct timespec now, ts;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  if (recvmsg(fd, &msg, MSG_PEEK | MSG_DONTWAIT) <= 0)
+    return -1;
+  for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+      clock_gettime(CLOCK_REALTIME, &now);   // the stamp is wall-clock time
+      return (now.tv_sec - ts.tv_sec) * 1000.0 + (now.tv_nsec - ts.tv_nsec) / 1e6;
+    }
+  return -1;
+}
+
+/*
+ * codel_shed - account a connection that waited sojourn ms and started at
+ *   now; returns 1 if it should be refused. The verdict on an interval is
+ *   made when the first connection after it arrives.
+ */
+int codel_shed(double sojourn, double now) {
+  int shed;
+
+  pthread_mutex_lock(&codel_mutex);
+  if (now >= codel_interval_end) {
+    codel_overloaded = codel_min > codel_target;
+    if (codel_overloaded)
+      log_msg(LOG_DEBUG, "@ Shedding load: shortest sojourn %.1f ms\n", codel_min);
+    codel_min = -1;
+    codel_interval_end = now + CODEL_INTERVAL_MS;
+  }
+  if (codel_min < 0 || sojourn < codel_min)
+    codel_min = sojourn;
+  shed = codel_overloaded && sojourn > 2 * codel_target;
+  pthread_mutex_unlock(&codel_mutex);
+  return shed;
+}
+
+/* Link t into the slot for its expiry. Caller holds timer_mutex. */
+static void timer_link(io_timer *t) {
+  unsigned long delta = t->expires - timer_tick;
+  io_timer *head;
+
+  if (delta < TIMER_SLOTS)
+    head = &timer_wheel[0][t->expires & (TIMER_SLOTS - 1)];
+  else {
+    if (delta >= TIMER_SLOTS * TIMER_SLOTS)   // beyond the outer wheel: fire as late as it can
+      t->expires = timer_tick + TIMER_SLOTS * TIMER_SLOTS - 1;
+    head = &timer_wheel[1][(t->expires / TIMER_SLOTS) & (TIMER_SLOTS - 1)];
+  }
+  t->next = head->next;
+  t->prev = head;
+  head->next->prev = t;
+  head->next = t;
+}
+
+static void timer_unlink(io_timer *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+/*
+ * timer_arm - shutdown(fd, how) if t is not disarmed within ms, so a read
+ *   blocked on it returns EOF (or, with SHUT_RDWR, a blocked write fails)
+ *   and t->fired tells why. Rearming a pending timer just moves it.
+ */
+void timer_arm(io_timer *t, int fd, double ms, int how) {
+  if (ms <= 0)
+    return;
+  pthread_mutex_lock(&timer_mutex);
+  if (t->next)
+    timer_unlink(t);
+  t->fd = fd;
+  t->how = how;
+  t->ms = ms;
+  t->fired = 0;
+  t->expires = timer_tick + 1 + (unsigned long)(ms / TIMER_TICK_MS);
+  timer_link(t);
+  pthread_mutex_unlock(&timer_mutex);
+}
+
+/* Push a pending timer's expiry ms further out: the peer made progress. */
+void timer_touch(io_timer *t) {
+  if (t->next)
+    timer_arm(t, t->fd, t->ms, t->how);
+}
+
+/* Disarm t. Must be done before its fd is closed. */
+void timer_cancel(io_timer *t) {
+  pthread_mutex_lock(&timer_mutex);
+  if (t->next)
+    timer_unlink(t);
+  pthread_mutex_unlock(&timer_mutex);
+}
+
+/* Make every slot an empty list. Called before any timer is armed. */
+void timer_init(void) {
+  io_timer *t;
+
+  for (t = &timer_wheel[0][0]; t < &timer_wheel[2][0]; t++)
+    t->next = t->prev = t;
+}
+
+/*
+ * Timer thread: advances the wheel every TIMER_TICK_MS. Each time the inner
+ * wheel wraps, the next outer slot is spread over it; then every timer in
+ * the current inner slot has expired.
+ */
+void *timer_thread(void *vargp) {
+  struct timespec ts = { 0, TIMER_TICK_MS * 1000000 };
+  io_timer *head, *t;
+  unsigned long target;
+  double start = now_ms();
+
+  while (1) {
+    nanosleep(&ts, NULL);
+    target = (now_ms() - start) / TIMER_TICK_MS;   // catch up on ticks lost to a late wakeup
+    pthread_mutex_lock(&timer_mutex);
+    while (timer_tick < target) {
+      timer_tick++;
+      if (!(timer_tick & (TIMER_SLOTS - 1))) {
+        head = &timer_wheel[1][(timer_tick / TIMER_SLOTS) & (TIMER_SLOTS - 1)];
+        while ((t = head->next) != head) {
+          timer_unlink(t);
+          timer_link(t);
+        }
+      }
+      head = &timer_wheel[0][timer_tick & (TIMER_SLOTS - 1)];
+      while ((t = head->next) != head) {
+        timer_unlink(t);
+        t->fired = 1;
+        shutdown(t->fd, t->how);
+        atomic_fetch_add(&timeouts, 1);
+      }
+    }
+    pthread_mutex_unlock(&timer_mutex);
+  }
+  return NULL;
+}
+
+/* Claim an epoch record for this thread, recycling one from a finished thread. */
+static epoch_rec *epoch_register(void) {
+  epoch_rec *rec;
+  int unused;
+
+  for (rec = atomic_load(&epoch_recs); rec; rec = rec->next) {
+    unused = 0;
+    if (atomic_compare_exchange_strong(&rec->in_use, &unused, 1))
+      return rec;
+  }
+  rec = (epoch_rec *)Malloc(sizeof(epoch_rec));
+  atomic_init(&rec->epoch, 0);
+  atomic_init(&rec->in_use, 1);
+  rec->next = atomic_load(&epoch_recs);
+  while (!atomic_compare_exchange_weak(&epoch_recs, &rec->next, rec))
+    ;
+  return rec;
+}
+
+void epoch_enter(void) {
+  if (!my_epoch)
+    my_epoch = epoch_register();
+  atomic_store(&my_epoch->epoch, atomic_load(&global_epoch));  // seq_cst: ordered before our reads
+}
+
+void epoch_exit(void) {
+  atomic_store_explicit(&my_epoch->epoch, 0, memory_order_release);
+}
+
+/* Called once when a connection thread finishes. */
+void epoch_release(void) {
+  if (my_epoch) {
+    atomic_store(&my_epoch->epoch, 0);
+    atomic_store(&my_epoch->in_use, 0);
+    my_epoch = NULL;
+  }
+}
+
+static void epoch_retire_at(cache_data *node, unsigned long epoch) {
+  node->retired_epoch = epoch;
+  node->next = atomic_load(&limbo);
+  while (!atomic_compare_exchange_weak(&limbo, &node->next, node))
+    ;
+}
+
+/* Queue an unreachable node for freeing. Safe from any thread. */
+void epoch_retire(cache_data *node) {
+  epoch_retire_at(node, atomic_load(&global_epoch));
+}
+
+/* Advance the epoch if every active reader has seen the current one, then
+   free whatever was retired two epochs ago. Caller holds cache_mutex, which
+   keeps reclaimers single; retirers may run concurrently. */
+void epoch_reclaim(void) {
+  unsigned long e = atomic_load(&global_epoch), seen;
+  epoch_rec *rec;
+  cache_data *node, *next;
+
+  for (rec = atomic_load(&epoch_recs); rec; rec = rec->next) {
+    seen = atomic_load(&rec->epoch);
+    if (seen && seen != e)
+      break;
+  }
+  if (!rec)
+    atomic_store(&global_epoch, ++e);
+
+  for (node = atomic_exchange(&limbo, NULL); node; node = next) {
+    next = node->next;
+    if (node->retired_epoch + 2 <= e)
+      free(node);
+    else
+      epoch_retire_at(node, node->retired_epoch);
+  }
+}
+
+/* Claim a log ring for this thread, recycling one from a finished thread. */
+static log_ring *log_register(void) {
+  log_ring *ring;
+  int unused;
+
+  for (ring = atomic_load(&log_rings); ring; ring = ring->next) {
+    unused = 0;
+    if (atomic_compare_exchange_strong(&ring->in_use, &unused, 1))
+      return ring;   // head/tail carry on where the last owner left them
+  }
+  ring = (log_ring *)Malloc(sizeof(log_ring));
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->in_use, 1);
+  ring->next = atomic_load(&log_rings);
+  while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring))
+    ;
+  return ring;
+}
+
+/* Append len bytes to this thread's ring as one record. Never blocks: if the
+   writer has fallen behind, the record is dropped and counted. */
+void log_write(int level, char *data, size_t len) {
+  size_t head, off, first;
+
+  if (level > log_level)
+    return;
+  if (!my_log)
+    my_log = log_register();
+  head = atomic_load_explicit(&my_log->head, memory_order_relaxed);
+  if (len > LOG_RING_SIZE - (head - atomic_load_explicit(&my_log->tail, memory_order_acquire))) {
+    atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+    return;
+  }
+  off = head & (LOG_RING_SIZE - 1);
+  first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+  memcpy(my_log->buf + off, data, first);
+  memcpy(my_log->buf, data + first, len - first);
+  atomic_store_explicit(&my_log->head, head + len, memory_order_release);
+}
+
+void log_msg(int level, const char *fmt, ...) {
+  char line[MAXBUF];
+  va_list ap;
+  int n;
+
+  if (level > log_level)
+    return;
+  va_start(ap, fmt);
+  n = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    log_write(level, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+/* Called once when a connection thread finishes; the writer still drains
+   whatever it left in the ring. */
+void log_release(void) {
+  if (my_log) {
+    atomic_store(&my_log->in_use, 0);
+    my_log = NULL;
+  }
+}
+
+/* Move everything queued so far to stdout. Returns the bytes written. */
+static size_t log_drain(void) {
+  log_ring *ring;
+  size_t head, tail, off, first, total = 0;
+
+  for (ring = atomic_load(&log_rings); ring; ring = ring->next) {
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (head == tail)
+      continue;
+    off = tail & (LOG_RING_SIZE - 1);
+    first = head - tail < LOG_RING_SIZE - off ? head - tail : LOG_RING_SIZE - off;
+    rio_writen(STDOUT_FILENO, ring->buf + off, first);
+    rio_writen(STDOUT_FILENO, ring->buf, head - tail - first);
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+    total += head - tail;
+  }
+  return total;
+}
+
+/* Log writer thread: the only consumer of the rings. */
+void *log_thread(void *vargp) {
+  char line[MAXLINE];
+  unsigned long dropped;
+
+  while (1) {
+    if ((dropped = atomic_exchange(&log_dropped, 0)) != 0) {
+      sprintf(line, "log: %lu lines dropped\n", dropped);
+      rio_writen(STDOUT_FILENO, line, strlen(line));
+    }
+    if (!log_drain())
+      usleep(LOG_IDLE_US);
+  }
+  return NULL;
+}
+
+/* Wait until the writer has emptied every ring (used before exiting). */
+void log_flush(void) {
+  log_ring *ring;
+  int i;
+
+  for (i = 0; i < 100; i++) {   // give up after ~100 idle periods
+    for (ring = atomic_load(&log_rings); ring; ring = ring->next)
+      if (atomic_load(&ring->head) != atomic_load(&ring->tail))
+        break;
+    if (!ring)
+      return;
+    usleep(LOG_IDLE_US);
+  }
+}
+
+/* Emit the access line for the request this thread just finished. */
+void log_access(char *hostname, char *port) {
+  access_rec *a = &my_access;
+  char stamp[32], upstream[32];
+  struct tm tm;
+  time_t now = time(NULL);
+
+  if (!a->method[0])
+    return;   // client sent nothing
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&now, &tm));
+  if (a->upstream_ms >= 0)
+    sprintf(upstream, "%.2f", a->upstream_ms);
+  else
+    strcpy(upstream, "-");
+  log_msg(LOG_INFO, "time=%s client=%s:%s method=%s uri=%s status=%d bytes=%zu cache=%s "
+          "upstream_ms=%s total_ms=%.2f\n", stamp, hostname, port, a->method, a->uri, a->status,
+          a->bytes, a->cache ? a->cache : "-", upstream, trace_span(T_ACCEPT, T_DONE));
+}
+
+/*
+ * Metrics. Latencies go into log-linear (HDR-style) histograms: 16 linear
+ * sub-buckets per power of two of microseconds, so every bucket is within
+ * ~6% of its value. Each connection thread folds its request into a
+ * per-thread block when it finishes; the admin thread sums the blocks only
+ * when scraped.
+ */
+static int hist_index(double ms) {
+  uint64_t v = ms > 0 ? (uint64_t)(ms * 1000) : 0;
+  int e;
+
+  if (v < HIST_SUB)
+    return v;
+  e = 63 - __builtin_clzll(v);
+  if (e > HIST_MAX_EXP)
+    return HIST_BUCKETS - 1;
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Exclusive upper bound of bucket i, in seconds */
+static double hist_upper(int i) {
+  int e;
+
+  if (i < HIST_SUB)
+    return (i + 1) / 1e6;
+  e = i / HIST_SUB + HIST_SUB_BITS - 1;
+  return (double)((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUB_BITS)) / 1e6;
+}
+
+/* Only the owner of a block writes it, so a plain load/store pair is enough
+   (no locked instruction on the request path). */
+static void counter_add(atomic_ulong *c, unsigned long n) {
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void hist_add(metrics_rec *m, int h, double ms) {
+  if (ms < 0)
+    return;   // phase did not happen for this request
+  counter_add(&m->hist[h][hist_index(ms)], 1);
+  counter_add(&m->sum_us[h], (unsigned long)(ms * 1000));
+}
+
+/* Claim a metrics block, recycling one whose thread has finished. */
+static metrics_rec *metrics_register(void) {
+  metrics_rec *m;
+  int unused;
+
+  for (m = atomic_load(&metrics_recs); m; m = m->next) {
+    unused = 0;
+    if (atomic_compare_exchange_strong(&m->in_use, &unused, 1))
+      return m;   // counts are cumulative, so the previous owner's stay
+  }
+  m = (metrics_rec *)Calloc(1, sizeof(metrics_rec));
+  atomic_init(&m->in_use, 1);
+  m->next = atomic_load(&metrics_recs);
+  while (!atomic_compare_exchange_weak(&metrics_recs, &m->next, m))
+    ;
+  return m;
+}
+
+/* Fold the request this thread just finished into the histograms. */
+void metrics_record(void) {
+  access_rec *a = &my_access;
+  metrics_rec *m;
+
+  if (!a->method[0])
+    return;
+  m = metrics_register();
+  hist_add(m, HIST_FIRST_BYTE, trace_span(T_ACCEPT, T_HEAD));
+  hist_add(m, HIST_DNS, trace_span(T_UPSTREAM, T_RESOLVED));
+  hist_add(m, HIST_CONNECT, trace_span(T_RESOLVED, T_CONNECTED));
+  hist_add(m, HIST_TTFB, trace_span(T_SENT, T_STATUS));
+  hist_add(m, HIST_TOTAL, trace_span(T_ACCEPT, T_DONE));
+  counter_add(&m->origin_bytes, a->origin_bytes);
+  atomic_store(&m->in_use, 0);
+}
+
+/* Mark the response head for this request as sent. */
+void note_head(int status) {
+  my_access.status = status;
+  trace_mark(T_HEAD);
+}
+
+static void metrics_printf(char *buf, size_t *len, const char *fmt, ...) {
+  va_list ap;
+
+  if (*len >= METRICS_BUF)
+    return;
+  va_start(ap, fmt);
+  *len += vsnprintf(buf + *len, METRICS_BUF - *len, fmt, ap);
+  va_end(ap);
+  if (*len > METRICS_BUF)
+    *len = METRICS_BUF;
+}
+
+/* Append one merged histogram as a Prometheus histogram plus its quantiles. */
+static void metrics_hist(char *buf, size_t *len, int h, char *name, char *help) {
+  static const double bounds[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                   0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  static unsigned long counts[HIST_BUCKETS];   // only the admin thread gets here
+  unsigned long total = 0, sum_us = 0, seen;
+  metrics_rec *m;
+  size_t b;
+  int i;
+
+  memset(counts, 0, sizeof(counts));
+  for (m = atomic_load(&metrics_recs); m; m = m->next) {
+    for (i = 0; i < HIST_BUCKETS; i++)
+      counts[i] += atomic_load_explicit(&m->hist[h][i], memory_order_relaxed);
+    sum_us += atomic_load_explicit(&m->sum_us[h], memory_order_relaxed);
+  }
+  for (i = 0; i < HIST_BUCKETS; i++)
+    total += counts[i];
+
+  metrics_printf(buf, len, "# HELP proxy_%s_seconds %s\n# TYPE proxy_%s_seconds histogram\n",
+                 name, help, name);
+  for (b = 0, i = 0, seen = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++) {
+    for (; i < HIST_BUCKETS && hist_upper(i) <= bounds[b] * (1 + 1e-9); i++)
+      seen += counts[i];
+    metrics_printf(buf, len, "proxy_%s_seconds_bucket{le=\"%g\"} %lu\n", name, bounds[b], seen);
+  }
+  metrics_printf(buf, len, "proxy_%s_seconds_bucket{le=\"+Inf\"} %lu\n", name, total);
+  metrics_printf(buf, len, "proxy_%s_seconds_sum %.6f\n", name, sum_us / 1e6);
+  metrics_printf(buf, len, "proxy_%s_seconds_count %lu\n", name, total);
+
+  metrics_printf(buf, len, "# TYPE proxy_%s_quantile_seconds gauge\n", name);
+  for (b = 0; b < sizeof(quantiles) / sizeof(quantiles[0]); b++) {
+    for (i = 0, seen = 0; i < HIST_BUCKETS - 1 && seen + counts[i] < quantiles[b] * total; i++)
+      seen += counts[i];
+    metrics_printf(buf, len, "proxy_%s_quantile_seconds{quantile=\"%g\"} %g\n", name, quantiles[b],
+                   total ? hist_upper(i) : 0.0);
+  }
+}
+
+/* Build the whole Prometheus text exposition into buf. */
+static size_t metrics_render(char *buf) {
+  cache_stats_t *s = &cache_stats;
+  unsigned long admitted, rejected, evictions, origin_bytes = 0;
+  size_t len = 0, cache_size;
+  metrics_rec *m;
+
+  pthread_mutex_lock(&cache_mutex);
+  admitted = s->admitted;
+  rejected = s->rejected;
+  evictions = s->evictions;
+  cache_size = total_cache_size;
+  pthread_mutex_unlock(&cache_mutex);
+  for (m = atomic_load(&metrics_recs); m; m = m->next)
+    origin_bytes += atomic_load_explicit(&m->origin_bytes, memory_order_relaxed);
+
+#define COUNTER(name, help, value) \
+  metrics_printf(buf, &len, "# HELP proxy_" name " " help "\n# TYPE proxy_" name " counter\n" \
+                 "proxy_" name " %lu\n", (unsigned long)(value))
+#define GAUGE(name, help, value) \
+  metrics_printf(buf, &len, "# HELP proxy_" name " " help "\n# TYPE proxy_" name " gauge\n" \
+                 "proxy_" name " %lu\n", (unsigned long)(value))
+  COUNTER("requests_total", "Requests received.", s->requests);
+  COUNTER("cache_hits_total", "Requests served from the RAM or disk cache.", s->hits);
+  COUNTER("cache_misses_total", "Requests sent to the origin.", s->requests - s->hits);
+  COUNTER("disk_hits_total", "Requests served from the disk tier.", s->disk_hits);
+  COUNTER("cache_admitted_total", "Objects admitted to the RAM cache.", admitted);
+  COUNTER("cache_rejected_total", "Objects refused admission by GDSF.", rejected);
+  COUNTER("cache_evictions_total", "Objects evicted from the RAM cache.", evictions);
+  COUNTER("disk_demotions_total", "Evicted objects copied to the disk tier.", s->demotions);
+  COUNTER("client_bytes_total", "Body bytes sent to clients.", s->bytes_served);
+  COUNTER("gzip_hits_total", "Cache hits served from the gzip variant.", s->gzip_hits);
+  COUNTER("gzip_saved_bytes_total", "Body bytes the gzip variants saved.", s->gzip_saved);
+  COUNTER("cache_hit_bytes_total", "Body bytes sent to clients from the cache.", s->bytes_hit);
+  COUNTER("origin_bytes_total", "Body bytes read from origins.", origin_bytes);
+  COUNTER("limited_connections_total", "Connections refused with 503 over the per-client cap.",
+          limited_conns);
+  COUNTER("limited_requests_total", "Requests refused with 429 by the per-client rate limit.",
+          limited_requests);
+  COUNTER("io_errors_total", "Connections cut short by a failed read or write, and disk tier failures.",
+          io_errors);
+  COUNTER("accept_errors_total", "Failed accept() calls.", accept_errors);
+  COUNTER("thread_errors_total", "Connections refused because no thread could be created.",
+          spawn_errors);
+  COUNTER("timeouts_total", "Client or origin reads, stalled responses and origin connects that timed out.",
+          timeouts);
+  COUNTER("shed_connections_total", "Connections refused with 503 because queueing exceeded -Q.",
+          shed_conns);
+  COUNTER("log_dropped_total", "Log records dropped because a ring was full.", log_dropped);
+  GAUGE("active_connections", "Client connections being served.", active_connections);
+  GAUGE("overloaded", "1 while connections are being shed.", codel_overloaded);
+  GAUGE("cache_size_bytes", "Bytes of object bodies and gzip variants held in the RAM cache.", cache_size);
+#undef COUNTER
+#undef GAUGE
+
+  metrics_hist(buf, &len, HIST_FIRST_BYTE, "first_byte", "Accept to first response byte.");
+  metrics_hist(buf, &len, HIST_DNS, "upstream_dns", "Resolving the origin host.");
+  metrics_hist(buf, &len, HIST_CONNECT, "upstream_connect", "TCP connect to the origin.");
+  metrics_hist(buf, &len, HIST_TTFB, "upstream_ttfb", "Request sent to origin status line.");
+  metrics_hist(buf, &len, HIST_TOTAL, "total", "Accept to connection close.");
+  return len;
+}
+
+/* Admin thread: serves GET /metrics on its own port, one request at a time. */
+void *metrics_thread(void *vargp) {
+  int listenfd = *(int *)vargp, connfd;
+  char buf[MAXLINE], method[MAXLINE], path[MAXLINE], *body;
+  rio_t rio;
+  size_t len;
+
+  body = Malloc(METRICS_BUF);
+  while (1) {
+    if ((connfd = accept(listenfd, NULL, NULL)) < 0)
+      continue;
+    Rio_readinitb(&rio, connfd);
+    method[0] = path[0] = '\0';
+    if (io_readlineb(&rio, buf, MAXLINE) > 0)
+      sscanf(buf, "%s %s", method, path);
+    while (io_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+      ;
+    if (strcasecmp(method, "GET") || strcmp(path, "/metrics"))
+      clienterror(connfd, path, "404", "Not found", "Try /metrics");
+    else {
+      len = metrics_render(body);
+      sprintf(buf, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: %zu\r\n\r\n", len);
+      io_writen(connfd, buf, strlen(buf));
+      io_writen(connfd, body, len);
+    }
+    close(connfd);
+  }
+  return NULL;
+}
+
+/* Stamp a phase of the current request; only its first occurrence counts. */
+void trace_mark(int phase) {
+  if (!my_access.t[phase])
+    my_access.t[phase] = now_ms();
+}
+
+/* Milliseconds between two phases of the current request, -1 if either
+   did not happen. */
+double trace_span(int from, int to) {
+  return my_access.t[from] && my_access.t[to] ? my_access.t[to] - my_access.t[from] : -1;
+}
+
+/* Log the phase timeline of the request this thread just finished if it
+   took at least slow_ms. Offsets are from accept. */
+void trace_dump(char *hostname, char *port) {
+  static char *names[T_COUNT] = { "accept", "thread", "request", "lookup", "upstream", "resolved",
+                                  "connected", "sent", "status", "fetched", "head", "body", "done" };
+  access_rec *a = &my_access;
+  char line[MAXBUF];
+  size_t len;
+  int i;
+
+  if (slow_ms < 0 || !a->method[0] || trace_span(T_ACCEPT, T_DONE) < slow_ms)
+    return;
+  len = snprintf(line, sizeof(line), "slow: client=%s:%s method=%s uri=%s status=%d cache=%s",
+                 hostname, port, a->method, a->uri, a->status, a->cache ? a->cache : "-");
+  for (i = T_THREAD; i < T_COUNT && len < sizeof(line); i++)
+    if (a->t[i])
+      len += snprintf(line + len, sizeof(line) - len, " %s=+%.3f", names[i], a->t[i] - a->t[T_ACCEPT]);
+  log_msg(LOG_INFO, "%s\n", line);
+}
+
+/*
+ * open_origin - open_clientfd, split so that the DNS lookup and the TCP
+ *   connect are stamped separately, with each connect attempt bounded by
+ *   connect_timeout. The returned fd has origin_timer armed on it; close it
+ *   with close_origin. Returns -1 on failure.
+ */
+int open_origin(char *host, char *port) {
+  struct addrinfo hints, *listp, *p;
+  struct pollfd pfd;
+  socklen_t len = sizeof(int);
+  int clientfd = -1, rc, flags;
+
+  trace_mark(T_UPSTREAM);
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;   // open a connection
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if ((rc = getaddrinfo(host, port, &hints, &listp)) != 0) {
+    log_msg(LOG_INFO, "getaddrinfo failed (%s:%s): %s\n", host, port, gai_strerror(rc));
+    return -1;
+  }
+  trace_mark(T_RESOLVED);
+
+  for (p = listp; p; p = p->ai_next) {
+    if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    flags = fcntl(clientfd, F_GETFL, 0);
+    if (connect_timeout > 0)
+      fcntl(clientfd, F_SETFL, flags | O_NONBLOCK);
+    rc = connect(clientfd, p->ai_addr, p->ai_addrlen) ? errno : 0;
+    if (rc == EINPROGRESS) {
+      pfd.fd = clientfd;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, connect_timeout) == 1)
+        getsockopt(clientfd, SOL_SOCKET, SO_ERROR, &rc, &len);
+      else {
+        rc = ETIMEDOUT;
+        atomic_fetch_add(&timeouts, 1);
+        log_msg(LOG_INFO, "connect timed out (%s:%s)\n", host, port);
+      }
+    }
+    if (rc == 0) {
+      fcntl(clientfd, F_SETFL, flags);
+      break;   // success
+    }
+    close(clientfd);
+    clientfd = -1;
+  }
+  freeaddrinfo(listp);
+  if (clientfd >= 0) {
+    trace_mark(T_CONNECTED);
+    timer_arm(&origin_timer, clientfd, origin_timeout, SHUT_RD);
+  }
+  return clientfd;
+}
+
+void close_origin(int fd) {
+  timer_cancel(&origin_timer);
+  io_close(fd);
+}
+
+double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * io_writen, io_readlineb, io_readnb - the rio functions without the exit:
+ *   a peer that resets or goes away fails only the connection it was on.
+ *   Errors are returned (as -1) for the caller to unwind.
+ */
+int io_writen(int fd, void *buf, size_t n) {
+  char *p = buf;
+  ssize_t rc;
+
+  while (n > 0) {
+    if ((rc = write(fd, p, n)) <= 0) {
+      if (rc < 0 && errno == EINTR)
+        continue;
+      io_failed("write");
+      return -1;
+    }
+    p += rc;
+    n -= rc;
+    if (fd == client_timer.fd)
+      timer_touch(&client_timer);   // the client is still reading
+  }
+  return 0;
+}
+
+ssize_t io_readlineb(rio_t *rp, void *buf, size_t maxlen) {
+  ssize_t rc;
+
+  if ((rc = rio_readlineb(rp, buf, maxlen)) < 0)
+    io_failed("read");
+  return rc;
+}
+
+ssize_t io_readnb(rio_t *rp, void *buf, size_t n) {
+  ssize_t rc;
+
+  if ((rc = rio_readnb(rp, buf, n)) < 0)
+    io_failed("read");
+  return rc;
+}
+
+/* close without the exit; a failure counts as the connection's I/O error. */
+void io_close(int fd) {
+  if (close(fd) < 0)
+    io_failed("close");
+}
+
+/* Count the connection's first I/O error; later ones are its echoes. */
+void io_failed(char *op) {
+  if (my_access.io_error)
+    return;
+  my_access.io_error = errno;
+  atomic_fetch_add(&io_errors, 1);
+  log_msg(LOG_DEBUG, "@ %s error: %s\n", op, strerror(errno));
 }
 
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
@@ -301,14 +3357,15 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longms
 
   /* Print the HTTP response */
   /* response headers */
+  note_head(atoi(errnum));
   sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  Rio_writen(fd, buf, strlen(buf));
+  io_writen(fd, buf, strlen(buf));
   sprintf(buf, "Content-type: text/html\r\n");
-  Rio_writen(fd, buf, strlen(buf));
+  io_writen(fd, buf, strlen(buf));
   sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-  Rio_writen(fd, buf, strlen(buf));
+  io_writen(fd, buf, strlen(buf));
   /* response body */
-  Rio_writen(fd, body, strlen(body));
+  io_writen(fd, body, strlen(body));
 }
 
 int parse_uri(char *uri, char *host, char *port, char *filename)
@@ -336,8 +3393,9 @@ int collect_requesthdrs(rio_t *rp, char *headers)
   char buf[MAXLINE], name[MAXLINE], data[MAXLINE];
   char *str = "User-Agent:/Connection:/Proxy-Connection:";
   while (1) {
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
+    if (io_readlineb(rp, buf, MAXLINE) <= 0)
+      return 0;   // the client hung up (or timed out) mid-headers
+    log_msg(LOG_DEBUG, "%s", buf);
     if (!strcmp(buf, "\r\n")) {
       sprintf(headers, "%s%s", headers, buf);
       //printf("%s", headers);
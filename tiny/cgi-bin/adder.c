@@ -1,38 +1,59 @@
 /*
- * adder.c - a minimal CGI program that adds two numbers together
+ * adder.c - a minimal CGI program that adds two numbers together.
+ *     Runs as a plain CGI program or as one of tiny's persistent workers;
+ *     built with -DTINY_PLUGIN it is adder.so, an in-process tiny plugin.
  */
 /* $begin adder */
 #include "csapp.h"
+#include "cgi.h"
+#include "plugin.h"
 
-int main(void) {
-  char *buf, *p;
-  char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
+/* Make the response body for the arguments "n1&n2" */
+static void add(char *arg1, char *arg2, char *content)
+{
   int n1=0, n2=0;
 
-  /* Extrace the two arguments */
-  if ((buf = getenv("QUERY_STRING")) != NULL) {
-    p = strchr(buf, '&');
-    *p = '\0';
-    strcpy(arg1, buf);
-    strcpy(arg2, p+1);
+  if (arg1 && arg2) {
     n1 = atoi(arg1);
     n2 = atoi(arg2);
   }
-
-  /* Make the response body */
-  sprintf(content, "QUERY_STRING=%s", buf);
   sprintf(content, "Welcome to add.com: ");
   sprintf(content, "%sThe Internet addition portal. \r\n<p>", content);
   sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", content, n1, n2, n1+n2);
   sprintf(content, "%sThanks for visiting!\r\n", content);
+}
+
+#ifdef TINY_PLUGIN
+void tiny_handle(tiny_request *req, tiny_response *resp)
+{
+  char content[MAXLINE];
 
-  /* Generate the HTTP response */
-  printf("Connection: close\r\n");
-  printf("Content-Length: %d\r\n", (int)strlen(content));
-  printf("Content-Type: text/html\r\n\r\n");
-  printf("%s", content);
-  fflush(stdout);
+  add(req->argc == 2 ? req->argv[0] : NULL, req->argc == 2 ? req->argv[1] : NULL, content);
+  resp->write(resp, content, strlen(content));
+}
+#else
+int main(void) {
+  char *buf, *p;
+  char content[MAXLINE];
 
+  while (cgi_accept()) {
+    /* Extrace the two arguments */
+    // a worker lives on after a bad query, so don't crash on one without '&'
+    if ((buf = getenv("QUERY_STRING")) != NULL && (p = strchr(buf, '&')) != NULL) {
+      *p = '\0';
+      add(buf, p+1, content);
+    }
+    else
+      add(NULL, NULL, content);
+
+    /* Generate the HTTP response */
+    printf("Connection: close\r\n");
+    printf("Content-Length: %d\r\n", (int)strlen(content));
+    printf("Content-Type: text/html\r\n\r\n");
+    printf("%s", content);
+    fflush(stdout);
+  }
   exit(0);
 }
+#endif
 /* $end adder */
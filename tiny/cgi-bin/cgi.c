@@ -0,0 +1,108 @@
+/*
+ * cgi.c - Worker side of tiny's persistent CGI protocol (see cgi.h).
+ *     Under a plain fork/exec, cgi_accept returns 1 once and the program
+ *     writes straight to the client. Under tiny's worker pool, stdout is
+ *     redirected to memory for each request and sent back framed when the
+ *     program asks for the next one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "cgi.h"
+
+#define CGI_PARAMS 32
+
+static int requests = 0;
+static int worker = -1;                 /* -1 until the first cgi_accept */
+static char *outbuf;                    /* the response being captured */
+static size_t outlen;
+static char *param_names[CGI_PARAMS];   /* set for the last request */
+static int nparams = 0;
+
+static int cgi_io(int fd, void *buf, size_t n, int out)
+{
+  char *p = buf;
+  ssize_t rc;
+
+  while (n > 0) {
+    rc = out ? write(fd, p, n) : read(fd, p, n);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      return -1;
+    p += rc;
+    n -= rc;
+  }
+  return 0;
+}
+
+static int cgi_send(int type, void *buf, size_t len)
+{
+  cgi_frame f;
+
+  f.type = type;
+  f.len = len;
+  if (cgi_io(CGI_WORKER_FD, &f, sizeof(f), 1) < 0)
+    return -1;
+  return len ? cgi_io(CGI_WORKER_FD, buf, len, 1) : 0;
+}
+
+/* Send the captured response of the last request, then CGI_END. */
+static int cgi_finish(void)
+{
+  size_t off, len;
+  int rc = 0;
+
+  fclose(stdout);
+  for (off = 0; off < outlen && rc == 0; off += len) {
+    len = outlen - off < CGI_FRAME_MAX ? outlen - off : CGI_FRAME_MAX;
+    rc = cgi_send(CGI_STDOUT, outbuf + off, len);
+  }
+  free(outbuf);
+  return rc < 0 ? -1 : cgi_send(CGI_END, NULL, 0);
+}
+
+/*
+ * cgi_accept - wait for the next request and set up its environment and
+ *   stdout. Returns 1 if there is a request to serve, 0 when done.
+ */
+int cgi_accept(void)
+{
+  char buf[CGI_FRAME_MAX + 1], *eq;
+  cgi_frame f;
+
+  if (worker < 0)
+    worker = getenv(CGI_WORKER_ENV) != NULL;
+  if (!worker)
+    return requests++ == 0;   /* plain CGI: exactly one request */
+
+  if (requests++ == 0) {
+    if (cgi_send(CGI_READY, NULL, 0) < 0)
+      return 0;
+  }
+  else if (cgi_finish() < 0)
+    return 0;
+
+  while (nparams > 0) {   /* forget the last request's variables */
+    unsetenv(param_names[--nparams]);
+    free(param_names[nparams]);
+  }
+  while (1) {
+    if (cgi_io(CGI_WORKER_FD, &f, sizeof(f), 0) < 0 || f.len > CGI_FRAME_MAX
+        || cgi_io(CGI_WORKER_FD, buf, f.len, 0) < 0)
+      return 0;   /* tiny went away */
+    buf[f.len] = '\0';
+    if (f.type == CGI_STDIN && f.len == 0)
+      break;   /* end of the request; tiny sends no request bodies yet */
+    if (f.type == CGI_PARAM && (eq = strchr(buf, '=')) != NULL && nparams < CGI_PARAMS) {
+      *eq = '\0';
+      setenv(buf, eq + 1, 1);
+      param_names[nparams++] = strdup(buf);
+    }
+  }
+  if ((stdout = open_memstream(&outbuf, &outlen)) == NULL)
+    return 0;
+  return 1;
+}
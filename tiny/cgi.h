@@ -0,0 +1,30 @@
+/*
+ * cgi.h - Framed protocol between tiny and its persistent CGI workers.
+ *     tiny starts each worker with one end of a Unix socket pair on
+ *     descriptor CGI_WORKER_FD and TINY_CGI_WORKER set in its environment.
+ *     Every message is a cgi_frame header followed by len bytes:
+ *
+ *       worker -> tiny  CGI_READY once at startup
+ *       tiny -> worker  CGI_PARAM "NAME=value" ..., CGI_STDIN ..., CGI_STDIN of length 0
+ *       worker -> tiny  CGI_STDOUT ..., CGI_END
+ *
+ *     A CGI program written as "while (cgi_accept()) { ... }" serves one
+ *     request as a plain fork/exec CGI program and many as a worker.
+ */
+#ifndef __CGI_H__
+#define __CGI_H__
+
+#define CGI_WORKER_ENV "TINY_CGI_WORKER"
+#define CGI_WORKER_FD 0
+#define CGI_FRAME_MAX 8192   /* largest payload of a single frame */
+
+enum { CGI_READY = 1, CGI_PARAM, CGI_STDIN, CGI_STDOUT, CGI_END };
+
+typedef struct {
+  unsigned int type;
+  unsigned int len;
+} cgi_frame;
+
+int cgi_accept(void);
+
+#endif /* __CGI_H__ */
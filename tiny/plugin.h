@@ -0,0 +1,35 @@
+/*
+ * plugin.h - In-process handlers for tiny. A plugin is a shared object
+ *     exporting TINY_HANDLER_SYM as a tiny_handler; "tiny -p prefix=file.so"
+ *     loads it at startup and sends it every GET whose URI starts with
+ *     prefix. It runs inside tiny, on whichever worker thread took the
+ *     connection, so it must be thread-safe and is trusted like tiny
+ *     itself; untrusted programs belong in cgi-bin.
+ */
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+#include <stddef.h>
+
+#define TINY_HANDLER_SYM "tiny_handle"
+#define TINY_MAX_ARGS 32
+
+/* the request, with its query string split at '&' */
+typedef struct {
+  const char *uri;
+  const char *query;           /* after '?', "" if none */
+  int argc;
+  char *argv[TINY_MAX_ARGS];
+} tiny_request;
+
+/* the response; tiny buffers the body and adds Content-Length */
+typedef struct tiny_response {
+  int status;                  /* 200 unless the handler sets it */
+  char content_type[64];       /* "text/html" unless the handler sets it */
+  void (*write)(struct tiny_response *r, const void *buf, size_t len);
+  void *priv;                  /* tiny's */
+} tiny_response;
+
+typedef void (*tiny_handler)(tiny_request *req, tiny_response *resp);
+
+#endif /* __PLUGIN_H__ */
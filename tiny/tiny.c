@@ -1,91 +1,347 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple, prethreaded HTTP/1.0 Web server that uses the
+ *     GET method to serve static and dynamic content. The main thread
+ *     accepts connections into a bounded buffer (sbuf) that a fixed pool
+ *     of worker threads (-t) drains, so one slow client only ties up one
+ *     worker.
  *
  * Updated 11/2019 droh
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
+ *
+ * Benchmark mode (-b) turns tiny into an origin for load tests: HTTP/1.1
+ * keep-alive, no per-request output, and synthetic
+ * objects under /bench/ whose size, latency, framing and freshness are
+ * picked by query parameters:
+ *
+ *   /bench/<name>?size=<bytes>&delay=<ms>&max-age=<s>&chunked=1
+ *
+ * Missing parameters fall back to -s, -l and -a.
  */
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <dlfcn.h>
+#include <zlib.h>
 #include "csapp.h"
+#include "sbuf.h"
+#include "cgi.h"
+#include "plugin.h"
+
+#define BENCH_BUF (64 << 10)   // synthetic bodies repeat this block
+#define THREADS_PER_CORE 4     // default pool size per online CPU
+#define SBUFSIZE 64            // accepted connections waiting for a worker
+#define FCACHE_BUCKETS 509     // hash buckets of the open-file cache
+
+/* an open file, ready to be sent */
+typedef struct fentry {
+  char path[MAXLINE];
+  char *name;                  // last component of path
+  int fd;
+  int wd;                      // inotify watch on its directory
+  unsigned long gen;           // fcache_gen before it was stat'ed
+  struct stat st;
+  char hdrs[2][MAXLINE];       // response head, indexed by keep-alive
+  size_t hdrs_len[2];
+  int refcnt;                  // 1 for the table + 1 per request sending it
+  int gzip;                    // the gzip variant of path minus ".gz"
+  off_t src_size;              // gzip: size and mtime of the file it was made from
+  struct timespec src_mtime;
+  struct fentry *hnext;        // hash chain
+  struct fentry *prev, *next;  // LRU list, most recent first
+} fentry;
+
+#define CGI_PROGRAMS 16        // programs that get a worker pool
+#define CGI_MAX_WORKERS 64     // workers per program
+#define CGI_READY_MS 1000      // how long a new worker may take to say CGI_READY
+#define CGI_RETRY_MS 1000      // how often a worker that would not start is retried
+#define PLUGINS 16             // -p plugins
+
+/* an in-process handler, loaded with -p prefix=file.so */
+typedef struct {
+  char prefix[MAXLINE];        // URIs starting with it go to handle
+  tiny_handler handle;
+} plugin;
+
+/* a plugin's response body, as it is written */
+typedef struct {
+  char *buf;
+  size_t len, cap;
+} plugin_body;
+
+#ifdef POSIX_SPAWN_USEVFORK
+#define SPAWN_FLAGS POSIX_SPAWN_USEVFORK
+#else
+#define SPAWN_FLAGS 0          // glibc >= 2.24 spawns with CLONE_VFORK regardless
+#endif
+
+/* persistent workers of one CGI program */
+typedef struct {
+  char path[MAXLINE];
+  int nlive;                   // workers running or being started
+  int fd[CGI_MAX_WORKERS];     // our end of each worker's socket
+  pid_t pid[CGI_MAX_WORKERS];
+  int idle[CGI_MAX_WORKERS];   // stack of idle workers
+  int nidle;
+  int dead[CGI_MAX_WORKERS];   // stack of slots without a worker
+  int ndead;
+  double retry_at;             // CLOCK_MONOTONIC ms before which dead slots are left alone
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;         // signaled when a worker becomes idle
+} cgi_pool;
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+void serve_conn(int fd);
+void doit_loop(int fd);
+int doit(int fd, rio_t *rio);
+int read_requesthdrs(rio_t *rp, int *gzip);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+int serve_static(int fd, fentry *e, int keepalive);
+size_t static_headers(char *buf, off_t filesize, char *filetype, int keepalive, int gzip);
+void fcache_init(void);
+fentry *fcache_get(char *filename);
+fentry *fcache_get_gz(char *filename, fentry *src);
+int gzip_file(fentry *src, char *dest);
+void fcache_put(fentry *e);
+void *fcache_watcher(void *vargp);
+int serve_bench(int fd, char *uri, int http11, int keepalive);
+long bench_param(char *query, char *name, long dflt);
+void *thread(void *vargp);
+void *worker(void *vargp);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
+pid_t cgi_exec(char *filename, int fd, int target, char **envp);
+void cgi_reaper_init(void);
+void cgi_reap(pid_t pid);
+void *cgi_reaper(void *vargp);
+void cgi_pool_add(char *uri);
+cgi_pool *cgi_pool_get(char *filename);
+int cgi_spawn(cgi_pool *p, int i);
+int cgi_acquire(cgi_pool *p);
+void cgi_release(cgi_pool *p, int i);
+void cgi_lost(cgi_pool *p, int i);
+int cgi_recv(int fd, void *buf, size_t n);
+int cgi_send(int fd, int type, char *buf, size_t len);
+int cgi_request(int fd, cgi_pool *p, int i, char *cgiargs, int *started);
+int serve_pooled(int fd, cgi_pool *p, char *cgiargs);
+void plugin_load(char *spec);
+plugin *plugin_find(char *uri);
+void plugin_write(tiny_response *r, const void *buf, size_t len);
+char *reason_phrase(int status);
+int serve_plugin(int fd, plugin *pl, char *uri, int keepalive);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
                  char *longmsg);
 
+int nthreads = -1;          // -t: worker threads, 0 = a thread per connection
+int static_mmap = 0;        // -M: send static files with mmap + write instead of sendfile
+sbuf_t sbuf;                // shared buffer of connected descriptors
+
+/* open-file cache */
+int fcache_capacity = 256;  // -c: files kept open, 0 = no caching
+fentry *fcache_table[FCACHE_BUCKETS];
+fentry fcache_lru;          // sentinel of the LRU list
+int fcache_count = 0;
+pthread_mutex_t fcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+int inotify_fd = -1;
+unsigned long fcache_gen = 0; // inotify events seen so far, under fcache_mutex
+char *gzip_dir = NULL;      // -g: where gzip variants without a sidecar are made
+
+/* persistent CGI workers */
+int cgi_workers = 2;        // -w: workers per CGI program, 0 = spawn every request
+cgi_pool cgi_pools[CGI_PROGRAMS];
+int cgi_npools = 0;          // -W programs, registered before any thread starts
+int reap_pipe[2];           // spawned children on their way to cgi_reaper
+
+/* in-process plugins */
+plugin plugins[PLUGINS];
+int nplugins = 0;
+
+/* benchmark mode settings */
+int bench = 0;              // -b: keep-alive, quiet
+long bench_size = 4096;     // -s: default /bench/ object size
+long bench_delay = 0;       // -l: default /bench/ latency in ms
+long bench_max_age = -1;    // -a: default /bench/ max-age, -1 = no Cache-Control
+char bench_block[BENCH_BUF];
+
 int main(int argc, char **argv) {
-  int listenfd, connfd;
+  int listenfd, connfd, opt, *connfdp;
   char hostname[MAXLINE], port[MAXLINE];
   socklen_t clientlen;
   struct sockaddr_storage clientaddr;
+  pthread_t tid;
 
   /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  while ((opt = getopt(argc, argv, "t:Mc:g:w:W:p:bs:l:a:")) != -1) {
+    switch (opt) {
+    case 'g': gzip_dir = optarg; break;
+    case 'p': plugin_load(optarg); break;
+    case 'W': cgi_pool_add(optarg); break;
+    case 'w': cgi_workers = atoi(optarg) < CGI_MAX_WORKERS ? atoi(optarg) : CGI_MAX_WORKERS; break;
+    case 'c': fcache_capacity = atoi(optarg); break;
+    case 't': nthreads = atoi(optarg); break;
+    case 'M': static_mmap = 1; break;
+    case 'b': bench = 1; break;
+    case 's': bench_size = atol(optarg); break;
+    case 'l': bench_delay = atol(optarg); break;
+    case 'a': bench_max_age = atol(optarg); break;
+    default: optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-t threads] [-M] [-c cached_files] [-g gzip_dir] [-w cgi_workers] [-W /cgi-bin/program] [-p prefix=plugin.so] [-b] [-s bench_size] [-l bench_delay_ms] "
+            "[-a bench_max_age] <port>\n", argv[0]);
     exit(1);
   }
+  for (opt = 0; opt < BENCH_BUF; opt++)
+    bench_block[opt] = 'a' + opt % 26;
+  Signal(SIGPIPE, SIG_IGN);   // a client hanging up must not kill the server
+  if (nthreads < 0)
+    nthreads = THREADS_PER_CORE * sysconf(_SC_NPROCESSORS_ONLN);
+  fcache_init();
+  if (gzip_dir && mkdir(gzip_dir, 0755) < 0 && errno != EEXIST)
+    unix_error("mkdir gzip_dir");
+  cgi_reaper_init();
 
-  listenfd = Open_listenfd(argv[1]);
+  listenfd = Open_listenfd(argv[optind]);
+  fcntl(listenfd, F_SETFD, FD_CLOEXEC);   // CGI children get only their own descriptors
+  if (nthreads > 0) {
+    sbuf_init(&sbuf, SBUFSIZE);
+    for (opt = 0; opt < nthreads; opt++)  /* Create worker threads */
+      Pthread_create(&tid, NULL, worker, NULL);
+  }
   while (1) {
     clientlen = sizeof(clientaddr);
-    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);  // line:netp:tiny:accept
-    Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-    printf("Accepted connection from (%s, %s)\n", hostname, port);
-    doit(connfd);   // line:netp:tiny:doit
-    Close(connfd);  // line:netp:tiny:close
+    // a failed accept (aborted handshake, out of descriptors) loses that connection only
+    if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {  // line:netp:tiny:accept
+      if (errno == EMFILE || errno == ENFILE)
+        usleep(10000);   // let connections finish rather than spin
+      continue;
+    }
+    fcntl(connfd, F_SETFD, FD_CLOEXEC);
+    if (!bench && !getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0))
+      printf("Accepted connection from (%s, %s)\n", hostname, port);
+    if (nthreads > 0)
+      sbuf_insert(&sbuf, connfd);  /* Insert connfd in buffer */
+    else {
+      connfdp = Malloc(sizeof(int));
+      *connfdp = connfd;
+      if (pthread_create(&tid, NULL, thread, connfdp)) {   // out of threads: drop it, don't die
+        close(connfd);
+        Free(connfdp);
+      }
+    }
   }
 }
 
-void doit(int fd) {
-  int is_static;
+/* Pool worker: serves connections from sbuf one at a time */
+void *worker(void *vargp) {
+  Pthread_detach(pthread_self());
+  while (1)
+    serve_conn(sbuf_remove(&sbuf));  /* Remove connfd from buffer */
+  return NULL;
+}
+
+/* -t 0: one thread per connection */
+void *thread(void *vargp) {
+  int connfd = *(int *)vargp;
+
+  Pthread_detach(pthread_self());
+  Free(vargp);
+  serve_conn(connfd);
+  return NULL;
+}
+
+void serve_conn(int fd) {
+  int one = 1;
+
+  // head and body go out in separate writes: without this, Nagle holds the
+  // body of a kept-alive response until the client's delayed ACK
+  if (bench)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  doit_loop(fd);   // line:netp:tiny:doit
+  close(fd);       // line:netp:tiny:close
+}
+
+/* Serve requests on fd until one of them ends the connection. */
+void doit_loop(int fd) {
+  rio_t rio;
+
+  Rio_readinitb(&rio, fd);            // fd에 대해서 입출력 수행할 rio 구조체 생성.
+  while (doit(fd, &rio))
+    ;
+}
+
+/* Serve one request. Returns 1 if the connection stays open for another. */
+int doit(int fd, rio_t *rio) {
+  int is_static, keepalive, http11, gzip;
   struct stat sbuf;
+  fentry *e, *g;
+  cgi_pool *p;
+  plugin *pl;
   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
   char filename[MAXLINE], cgiargs[MAXLINE];
-  rio_t rio;
 
   /* Read request line and headers */
-  Rio_readinitb(&rio, fd);            // fd에 대해서 입출력 수행할 rio 구조체 생성.
-  Rio_readlineb(&rio, buf, MAXLINE);  // 요청 라인 읽어서 buf에 넣어줌.
-  printf("Request headers:\n");
-  printf("%s", buf);
+  if (rio_readlineb(rio, buf, MAXLINE) <= 0)  // 요청 라인 읽어서 buf에 넣어줌.
+    return 0;   // client closed (or reset) the connection
+  if (!bench) {
+    printf("Request headers:\n");
+    printf("%s", buf);
+  }
     
+  method[0] = uri[0] = version[0] = '\0';
   sscanf(buf, "%s %s %s", method, uri, version); // buf에서 띄어쓰기로 구분된 문자열 3개를 읽어서 뒤의 변수에 넣어줌.
   if (strcasecmp(method, "GET")) {
     clienterror(fd, method, "501", "Not implemented",
               "Tiny does not implement this method");
-    return;
+    return 0;
   }
-  read_requesthdrs(&rio);
+  http11 = !strcmp(version, "HTTP/1.1");
+  // only HTTP/1.1 without "Connection: close" keeps the connection, and only in -b
+  keepalive = !read_requesthdrs(rio, &gzip) && http11 && bench;
+
+  /* Synthetic benchmark objects */
+  if (!strncmp(uri, "/bench/", 7))
+    return serve_bench(fd, uri, http11, keepalive);
+
+  /* In-process plugins */
+  if ((pl = plugin_find(uri)) != NULL)
+    return serve_plugin(fd, pl, uri, keepalive);
 
   /* Parse URI from GET request */
   is_static = parse_uri(uri, filename, cgiargs);  // filename, cgiargs에 리턴을 받는 것.
+  if (is_static && (e = fcache_get(filename)) != NULL) {   // open, readable regular file
+    g = gzip ? fcache_get_gz(filename, e) : NULL;
+    keepalive = serve_static(fd, g && g->st.st_size < e->st.st_size ? g : e, keepalive);
+    if (g)
+      fcache_put(g);
+    fcache_put(e);
+    return keepalive;
+  }
   if (stat(filename, &sbuf) < 0) {    // filename에 해당하는 file 정보를 sbuf에 저장받음.
     clienterror(fd, filename, "404", "Not found",
               "Tiny couldn't find this file");
-    return;
+    return 0;
   }
   
   /* Serve static content */
-  if (is_static) {
-    if(!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {   // file이 regular파일이 아니거나, readable하지 않은 filename일 경우.
-      clienterror(fd, filename, "403", "Forbidden",
+  if (is_static) {   // it exists, yet fcache_get could not open it as a readable regular file
+    clienterror(fd, filename, "403", "Forbidden",
               "Tiny couldn't read this file");
-      return;
-    }
-    serve_static(fd, filename, sbuf.st_size);
+    return 0;
   }
   /* Serve dynamic content */
   else {
     if(!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {   // file이 regular파일이 아니거나, executable하지 않은 filename일 경우.
       clienterror(fd, filename, "403", "Forbidden",
               "Tiny couldn't run the CGI program");
-      return;
+      return 0;
     }
-    serve_dynamic(fd, filename, cgiargs);    
+    if ((p = cgi_pool_get(filename)) == NULL || serve_pooled(fd, p, cgiargs) < 0)
+      serve_dynamic(fd, filename, cgiargs);
+    return 0;   // the CGI program's output is delimited by closing
   }
 }
 
@@ -102,27 +358,38 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longms
 
   /* Print the HTTP response */
   /* response headers */
+  // the connection closes after an error, so a client that left is not checked for
   sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  Rio_writen(fd, buf, strlen(buf));
+  rio_writen(fd, buf, strlen(buf));
   sprintf(buf, "Content-Type: text/html\r\n");
-  Rio_writen(fd, buf, strlen(buf));
+  rio_writen(fd, buf, strlen(buf));
   sprintf(buf, "Content-Length: %d\r\n\r\n", (int)strlen(body));
-  Rio_writen(fd, buf, strlen(buf));
+  rio_writen(fd, buf, strlen(buf));
   /* response body */
-  Rio_writen(fd, body, strlen(body));
+  rio_writen(fd, body, strlen(body));
 }
 
-void read_requesthdrs(rio_t *rp)
+/* Returns 1 if the client asked for "Connection: close" (or went away). */
+int read_requesthdrs(rio_t *rp, int *gzip)
 {
-  char buf[MAXLINE];
+  char buf[MAXLINE], *p;
+  int want_close = 0;
 
-  Rio_readlineb(rp, buf, MAXLINE);
-  printf("%s", buf);
-  while(strcmp(buf, "\r\n")) {  // 0이 아닌 값(true)이 나올 때. 즉, readline했을 때 값이 "\r\n"가 아닐 때.
-    Rio_readlineb(rp, buf, MAXLINE);  // 읽고서,
-    printf("%s", buf);  // 그냥 서버측 표춘 출력으로 출력해버림
-  }
-  return;
+  *gzip = 0;
+  do {  // 0이 아닌 값(true)이 나올 때. 즉, readline했을 때 값이 "\r\n"가 아닐 때.
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)  // 읽고서,
+      return 1;
+    if (!bench)
+      printf("%s", buf);  // 그냥 서버측 표춘 출력으로 출력해버림
+    if (!strncasecmp(buf, "Connection:", 11) && (strstr(buf, "close") || strstr(buf, "Close")))
+      want_close = 1;
+    if (!strncasecmp(buf, "Accept-Encoding:", 16) && (p = strstr(buf, "gzip")) != NULL) {
+      for (p += 4; *p == ' '; p++)
+        ;
+      *gzip = *p != ';' || (p = strstr(p, "q=")) == NULL || atof(p + 2) > 0;   // "gzip;q=0" refuses it
+    }
+  } while(strcmp(buf, "\r\n"));
+  return want_close;
 }
 
 int parse_uri(char *uri, char *filename, char *cgiargs)
@@ -152,35 +419,446 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
   }
 }
 
-void serve_static(int fd, char *filename, int filesize)
+/* Returns keepalive, or 0 if the client went away. */
+int serve_static(int fd, fentry *e, int keepalive)
 {
-  int srcfd;  // source file descriptor
   char *srcp; // source pointer
-  char filetype[MAXLINE], buf[MAXLINE];
+  off_t filesize = e->st.st_size, offset = 0;
+  int on = 1, off = 0;
+  ssize_t n;
 
-  /* Send response headers to client*/
-  get_filetype(filename, filetype);  //filename : "./some/whatever.html"
-  
-  // make request line
-  sprintf(buf, "HTTP/1.0 200 OK\r\n");
-  // make request headers
-  sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-  sprintf(buf, "%sConnection: close\r\n", buf);
-  sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-  sprintf(buf, "%sContent-Type: %s\r\n\r\n", buf, filetype);    // use of filetype
-  // send
-  Rio_writen(fd, buf, strlen(buf));
+  // send. Corked, the head leaves in the same segment as the start of the body.
+  if (!static_mmap)
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+  if (rio_writen(fd, e->hdrs[keepalive], e->hdrs_len[keepalive]) < 0)
+    return 0;
+  if (!bench) {
     printf("Response headers:\n");
-    printf("%s", buf);
+    printf("%s", e->hdrs[keepalive]);
+  }
 
   /* Send response body to client */
-  srcfd = Open(filename, O_RDONLY, 0);  // 디스크 파일 연다.
+  if (!static_mmap) {   // the kernel copies page cache to the socket: no mapping, no user copy
+    // a private offset: the cached descriptor is shared between workers
+    while (offset < filesize) {
+      if ((n = sendfile(fd, e->fd, &offset, filesize - offset)) <= 0) {
+        if (n < 0 && errno == EINTR)
+          continue;
+        keepalive = 0;   // client went away
+        break;
+      }
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));  // uncork: flush the tail
+    return keepalive;
+  }
+  if (filesize == 0)
+    return keepalive;   // nothing to map
   // make request body
-  srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0); // 디스크에 있는 file을 Mmap으로 메모리에 올려놓고, (일종의 버퍼라고 생각해도 되겠다)
-  Close(srcfd); // 디스크파일은 닫고,
+  srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, e->fd, 0); // 디스크에 있는 file을 Mmap으로 메모리에 올려놓고, (일종의 버퍼라고 생각해도 되겠다)
+  if (srcp == MAP_FAILED)
+    return 0;
   // send
-  Rio_writen(fd, srcp, filesize); // connfd에 (메모리에 올려진) 디스크파일 내용 적는다. 즉, client에게 파일 내용을 보낸다.
-  Munmap(srcp, filesize); // 마친후, 디스크파일 올려놨던 메모리 공간도 반환.
+  if (rio_writen(fd, srcp, filesize) < 0) // connfd에 (메모리에 올려진) 디스크파일 내용 적는다. 즉, client에게 파일 내용을 보낸다.
+    keepalive = 0;
+  munmap(srcp, filesize); // 마친후, 디스크파일 올려놨던 메모리 공간도 반환.
+  return keepalive;
+}
+
+/*
+ * static_headers - build the response head for a static file (its gzip
+ *   variant if gzip) into buf (MAXLINE bytes) and return its length.
+ */
+size_t static_headers(char *buf, off_t filesize, char *filetype, int keepalive, int gzip)
+{
+  size_t len;
+
+  // make request line
+  len = snprintf(buf, MAXLINE, "HTTP/1.0 200 OK\r\n");
+  // make request headers
+  len += snprintf(buf + len, MAXLINE - len, "Server: Tiny Web Server\r\n");
+  len += snprintf(buf + len, MAXLINE - len, "Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+  len += snprintf(buf + len, MAXLINE - len, "Content-Length: %lld\r\n", (long long)filesize);
+  if (!strncmp(filetype, "text/", 5))   // text may also be sent gzipped
+    len += snprintf(buf + len, MAXLINE - len, "Vary: Accept-Encoding\r\n");
+  if (gzip)
+    len += snprintf(buf + len, MAXLINE - len, "Content-Encoding: gzip\r\n");
+  len += snprintf(buf + len, MAXLINE - len, "Content-Type: %s\r\n\r\n", filetype);    // use of filetype
+  return len;
+}
+
+/*
+ * Open-file cache. A hit hands back an already open descriptor, its stat
+ * data and a ready-made response head, so serving it costs no filesystem
+ * syscalls besides the sendfile. The directory of every cached file is
+ * watched with inotify and any change to a file drops its entry. Entries
+ * are reference counted: the table holds one reference and every request
+ * serving the file holds another, so eviction never closes a descriptor
+ * that is still being sent from.
+ */
+void fcache_init(void)
+{
+  pthread_t tid;
+
+  fcache_lru.next = fcache_lru.prev = &fcache_lru;
+  if (fcache_capacity <= 0)
+    return;
+  if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+    fprintf(stderr, "inotify_init: %s; file cache disabled\n", strerror(errno));
+    fcache_capacity = 0;
+    return;
+  }
+  Pthread_create(&tid, NULL, fcache_watcher, NULL);
+}
+
+static unsigned fcache_hash(char *path)
+{
+  unsigned h = 5381;
+
+  while (*path)
+    h = h * 33 + (unsigned char)*path++;
+  return h % FCACHE_BUCKETS;
+}
+
+/* Caller holds fcache_mutex. */
+static void fcache_unref(fentry *e)
+{
+  if (--e->refcnt == 0) {
+    close(e->fd);
+    Free(e);
+  }
+}
+
+/* Take e out of the table. Caller holds fcache_mutex. */
+static void fcache_unlink(fentry *e)
+{
+  fentry **pp;
+
+  for (pp = &fcache_table[fcache_hash(e->path)]; *pp != e; pp = &(*pp)->hnext)
+    ;
+  *pp = e->hnext;
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+  fcache_count--;
+  fcache_unref(e);
+}
+
+static unsigned long fcache_generation(void)
+{
+  unsigned long gen;
+
+  pthread_mutex_lock(&fcache_mutex);
+  gen = fcache_gen;
+  pthread_mutex_unlock(&fcache_mutex);
+  return gen;
+}
+
+/* Watch the directory holding path; returns the watch descriptor. */
+static int fcache_watch(char *path)
+{
+  char dir[MAXLINE], *slash;
+
+  strcpy(dir, path);
+  if ((slash = strrchr(dir, '/')) == NULL)
+    strcpy(dir, ".");
+  else
+    *slash = '\0';
+  // the same directory always yields the same descriptor
+  return inotify_add_watch(inotify_fd, dir, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE
+                           | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+}
+
+/*
+ * fcache_lookup - find and pin the entry for path (its gzip variant if
+ *   gzip). A gzip variant built from an older src than the current one is
+ *   dropped instead. Returns NULL on a miss.
+ */
+static fentry *fcache_lookup(char *path, int gzip, fentry *src)
+{
+  fentry *e;
+
+  pthread_mutex_lock(&fcache_mutex);
+  for (e = fcache_table[fcache_hash(path)]; e; e = e->hnext)
+    if (e->gzip == gzip && !strcmp(e->path, path))
+      break;
+  if (e && gzip && (e->src_size != src->st.st_size || e->src_mtime.tv_sec != src->st.st_mtim.tv_sec
+                    || e->src_mtime.tv_nsec != src->st.st_mtim.tv_nsec)) {
+    fcache_unlink(e);   // the file changed since its variant was made
+    e = NULL;
+  }
+  if (e) {
+    e->refcnt++;
+    e->prev->next = e->next;   // move to the front of the LRU list
+    e->next->prev = e->prev;
+    e->next = fcache_lru.next;
+    e->prev = &fcache_lru;
+    fcache_lru.next->prev = e;
+    fcache_lru.next = e;
+  }
+  pthread_mutex_unlock(&fcache_mutex);
+  return e;
+}
+
+/*
+ * Cache a new entry, pinned by the caller; returns it. Without cache (no
+ *   inotify watch covers it), or if some event arrived since e->gen, the
+ *   entry stays private to the caller: the event may have been for this
+ *   file, and it was handled before the entry was there to drop.
+ */
+static fentry *fcache_insert(fentry *e, int cache)
+{
+  fentry *old;
+
+  e->refcnt = 1;   // the caller's
+  e->name = strrchr(e->path, '/') ? strrchr(e->path, '/') + 1 : e->path;
+  if (fcache_capacity <= 0 || !cache)
+    return e;   // uncached: closed when the caller puts it
+
+  pthread_mutex_lock(&fcache_mutex);
+  for (old = fcache_table[fcache_hash(e->path)]; old; old = old->hnext)
+    if (old->gzip == e->gzip && !strcmp(old->path, e->path))
+      break;
+  // another worker may have cached it meanwhile; keep ours private then
+  if (!old && e->gen == fcache_gen && fcache_capacity > 0) {
+    e->refcnt++;   // the table's
+    e->hnext = fcache_table[fcache_hash(e->path)];
+    fcache_table[fcache_hash(e->path)] = e;
+    e->next = fcache_lru.next;
+    e->prev = &fcache_lru;
+    fcache_lru.next->prev = e;
+    fcache_lru.next = e;
+    if (++fcache_count > fcache_capacity)
+      fcache_unlink(fcache_lru.prev);   // least recently used
+  }
+  pthread_mutex_unlock(&fcache_mutex);
+  return e;
+}
+
+/*
+ * fcache_get - pin the entry for filename, opening and caching the file on
+ *   a miss. Returns NULL if it is not a readable regular file, in which case
+ *   the caller reports the error as before.
+ */
+fentry *fcache_get(char *filename)
+{
+  fentry *e;
+  char filetype[MAXLINE];
+  int wd = -1, k;
+
+  if ((e = fcache_lookup(filename, 0, NULL)) != NULL)
+    return e;
+
+  /* miss: watch first; a change from then on either reaches the entry in the
+     table or bumps the generation before fcache_insert */
+  if (fcache_capacity > 0)
+    wd = fcache_watch(filename);   // failing (ENOSPC, EACCES): serve it uncached
+  e = Malloc(sizeof(fentry));
+  e->gen = fcache_generation();
+  if (stat(filename, &e->st) < 0 || !S_ISREG(e->st.st_mode) || !(S_IRUSR & e->st.st_mode)
+      || (e->fd = open(filename, O_RDONLY | O_CLOEXEC, 0)) < 0) {
+    Free(e);
+    return NULL;
+  }
+  strcpy(e->path, filename);
+  e->wd = wd;
+  e->gzip = 0;
+  get_filetype(filename, filetype);
+  for (k = 0; k < 2; k++)
+    e->hdrs_len[k] = static_headers(e->hdrs[k], e->st.st_size, filetype, k, 0);
+  return fcache_insert(e, wd >= 0);
+}
+
+/*
+ * fcache_get_gz - pin the gzip variant of src, the entry for filename.
+ *   A filename.gz sidecar at least as new as the file is used as is;
+ *   failing that, with -g, one is made under gzip_dir the first time it is
+ *   asked for. Returns NULL for types not worth compressing or when there
+ *   is no variant. The caller still compares sizes: a variant that came
+ *   out larger stays cached so it is not remade, but is not worth sending.
+ */
+fentry *fcache_get_gz(char *filename, fentry *src)
+{
+  char path[MAXLINE], file[MAXLINE], filetype[MAXLINE], *p, *q;
+  struct stat st;
+  fentry *e;
+  int k, fd;
+  unsigned long gen;
+
+  get_filetype(filename, filetype);
+  if (strncmp(filetype, "text/", 5) || strlen(filename) + 3 >= MAXLINE)
+    return NULL;
+  sprintf(path, "%s.gz", filename);
+  if ((e = fcache_lookup(path, 1, src)) != NULL)
+    return e;
+
+  /* miss: a fresh sidecar, or our own copy */
+  gen = fcache_generation();
+  strcpy(file, path);
+  if (stat(file, &st) < 0 || !S_ISREG(st.st_mode) || st.st_mtime < src->st.st_mtime) {
+    if (gzip_dir == NULL || strlen(gzip_dir) + 3 * strlen(path) + 2 >= MAXLINE)
+      return NULL;
+    // "./a/b.html.gz" is stored as "<dir>/.%2Fa%2Fb.html.gz"
+    for (p = file + sprintf(file, "%s/", gzip_dir), q = path; *q; q++)
+      p += *q == '/' || *q == '%' ? sprintf(p, "%%%02X", *q) : sprintf(p, "%c", *q);
+    if ((stat(file, &st) < 0 || st.st_mtime < src->st.st_mtime) && gzip_file(src, file) < 0)
+      return NULL;
+  }
+  if ((fd = open(file, O_RDONLY | O_CLOEXEC, 0)) < 0)
+    return NULL;
+  e = Malloc(sizeof(fentry));
+  e->fd = fd;
+  e->gen = gen;
+  fstat(fd, &e->st);
+  strcpy(e->path, path);
+  e->wd = strcmp(file, path) ? -1 : src->wd;   // a sidecar shares its file's directory
+  e->gzip = 1;
+  e->src_size = src->st.st_size;
+  e->src_mtime = src->st.st_mtim;
+  for (k = 0; k < 2; k++)
+    e->hdrs_len[k] = static_headers(e->hdrs[k], e->st.st_size, filetype, k, 1);
+  return fcache_insert(e, e->wd >= 0 || strcmp(file, path));   // an unwatched sidecar is not cached
+}
+
+/*
+ * gzip_file - compress the file of src into dest. It is written under a
+ *   temporary name and renamed into place, so other workers never open a
+ *   half-written copy. Returns 0 on success, -1 on error.
+ */
+int gzip_file(fentry *src, char *dest)
+{
+  char tmp[MAXLINE + 32], buf[MAXBUF];
+  off_t off = 0;
+  ssize_t n;
+  gzFile gz;
+  int fd;
+
+  sprintf(tmp, "%s.%lx.tmp", dest, (unsigned long)pthread_self());
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    return -1;
+  if ((gz = gzdopen(fd, "wb9")) == NULL) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  while ((n = pread(src->fd, buf, sizeof(buf), off)) > 0 && gzwrite(gz, buf, n) == n)
+    off += n;
+  if (gzclose(gz) != Z_OK || n != 0 || rename(tmp, dest) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* Drop a reference taken by fcache_get. */
+void fcache_put(fentry *e)
+{
+  pthread_mutex_lock(&fcache_mutex);
+  fcache_unref(e);
+  pthread_mutex_unlock(&fcache_mutex);
+}
+
+/*
+ * inotify thread: drop entries for files that change under us. If the
+ *   inotify descriptor fails, nothing can be trusted to stay fresh: the
+ *   cache is emptied and turned off, and files are served uncached.
+ */
+void *fcache_watcher(void *vargp)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  fentry *e, *next;
+  ssize_t n;
+  char *p;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    if ((n = read(inotify_fd, buf, sizeof(buf))) <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      fprintf(stderr, "inotify read: %s; file cache disabled\n", n < 0 ? strerror(errno) : "EOF");
+      pthread_mutex_lock(&fcache_mutex);
+      fcache_capacity = 0;
+      while (fcache_lru.next != &fcache_lru)
+        fcache_unlink(fcache_lru.next);
+      pthread_mutex_unlock(&fcache_mutex);
+      break;
+    }
+    pthread_mutex_lock(&fcache_mutex);
+    fcache_gen++;
+    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *)p;
+      for (e = fcache_lru.next; e != &fcache_lru; e = next) {
+        next = e->next;
+        // a lost event queue or a vanished directory: trust nothing
+        if ((ev->mask & IN_Q_OVERFLOW)
+            || (e->wd == ev->wd && (!ev->len || !strcmp(e->name, ev->name))))
+          fcache_unlink(e);
+      }
+    }
+    pthread_mutex_unlock(&fcache_mutex);
+  }
+  return NULL;
+}
+
+/*
+ * serve_bench - send a synthetic object for /bench/. HTTP/1.1 clients may
+ *   ask for chunked framing; HTTP/1.0 ones get it delimited by closing
+ *   instead. Returns 1 if the connection can carry another request.
+ */
+int serve_bench(int fd, char *uri, int http11, int keepalive)
+{
+  char buf[MAXLINE], *query = strchr(uri, '?');
+  long size, delay, max_age, n, sent;
+  int chunked;
+
+  size = bench_param(query, "size", bench_size);
+  delay = bench_param(query, "delay", bench_delay);
+  max_age = bench_param(query, "max-age", bench_max_age);
+  chunked = bench_param(query, "chunked", 0) != 0;
+  if (chunked && !http11)
+    keepalive = 0;   // no chunked framing in 1.0: the close ends the body
+  if (delay > 0)
+    usleep(delay * 1000);   // origin think time
+
+  n = sprintf(buf, "HTTP/1.%d 200 OK\r\nServer: Tiny Web Server\r\nContent-Type: text/plain\r\n"
+              "Connection: %s\r\n", http11, keepalive ? "keep-alive" : "close");
+  if (max_age >= 0)
+    n += sprintf(buf + n, "Cache-Control: max-age=%ld\r\n", max_age);
+  if (!chunked)
+    n += sprintf(buf + n, "Content-Length: %ld\r\n", size);
+  else if (http11)
+    n += sprintf(buf + n, "Transfer-Encoding: chunked\r\n");
+  n += sprintf(buf + n, "\r\n");
+  if (rio_writen(fd, buf, n) < 0)
+    return 0;
+
+  for (sent = 0; sent < size; sent += n) {
+    n = size - sent < BENCH_BUF ? size - sent : BENCH_BUF;
+    if (chunked && http11) {
+      sprintf(buf, "%lx\r\n", n);
+      if (rio_writen(fd, buf, strlen(buf)) < 0)
+        return 0;
+    }
+    if (rio_writen(fd, bench_block, n) < 0
+        || (chunked && http11 && rio_writen(fd, "\r\n", 2) < 0))
+      return 0;
+  }
+  if (chunked && http11 && rio_writen(fd, "0\r\n\r\n", 5) < 0)
+    return 0;
+  return keepalive;
+}
+
+/* Value of name=<number> in a query string, or dflt */
+long bench_param(char *query, char *name, long dflt)
+{
+  char *p;
+  size_t len = strlen(name);
+
+  for (p = query; p; p = strchr(p, '&')) {
+    p++;   // past '?' or '&'
+    if (!strncmp(p, name, len) && p[len] == '=')
+      return atol(p + len + 1);
+  }
+  return dflt;
 }
 
 /* available file type : HTML, text, GIF, PNG, JPEG */
@@ -202,33 +880,516 @@ void get_filetype(char *filename, char *filetype)
 
 void serve_dynamic(int fd, char *filename, char *cgiargs)
 {
-  char buf[MAXLINE];
-  char *emptylist[] = {NULL};
+  char buf[MAXLINE], query[MAXLINE + 16];
+  char **envp;
+  pid_t pid;
+  int i, n;
 
   /* Return first part of HTTP response */
   // make and send response line
   sprintf(buf, "HTTP/1.0 200 OK\r\n");
-  Rio_writen(fd, buf, strlen(buf));
+  if (rio_writen(fd, buf, strlen(buf)) < 0)
+    return;   // client went away: nothing to run the program for
   // make and send part of response headers
   sprintf(buf, "Server: Tiny Web Server\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-
-  if (Fork() == 0) { /* Child */
-    /* Real server would set all CGI vars here */
-    setenv("QUERY_STRING", cgiargs, 1);
-    Dup2(fd, STDOUT_FILENO);  // Dup2(int oldfd, int newfd): creates a copy of the file descriptor oldfd to file descriptor newfd.
-                              // If the file descriptor newfd was previously open, it is silently closed before being reused.
-                              // 한국말: newfd 식별자가 oldfd 식별자가 가리키는 open file을 가리키게 한다.
-                              // newfd 식별자가 원래 어떤 open file을 가리키고 있었다면,
-                              // 가리키던 open file의 참조 횟수를 1 감소시킨다. (어떤 open file의 참조회수가 0이 되면 커널은 그 파일을 닫는다.)
-                              // * 우리 코드 에서*
-                              // 기억할 것: 자식 프로세스는 부모 프로세스의 식별자 테이블을 그대로 복사해서 자신만의 식별자 테이블을 갖는다.
-                              // 그래서, 자식 프로세스의 식별자 테이블을 부모 프로세스의 식별자 테이블이 가리키는 오픈 파일들을 동일하게 가리키고 있을 것이다.
-                              // 자식 프로세스의 식별자 테이블에서 식별자 1(표준출력)은 부모의 식별자 테이블에서와 마찬가지로 '터미널(쉘)'이라는 '파일'을 가리키고 있을 것이다.
-                              // dup2(connfd, STDOUT_FILENO) 를 통해 자식 프로세스의 식별자 테이블에서 식별자 1은, 자신의 식별자 테이블에서 식별자 connfd가 가리키던 오픈 파일을 가리키게 된다. 부모 프로세스의 식별자 테이블에서 connfd가 가리키던 오픈 파일은 연결소켓이었으므로, 자식 프로세스의 식별자 테이블에서의 connfd가 가리키던 오픈 파일 또한 동일할 것이다.
-                              // (부모 프로세스의 식별자 테이블에서 식별자 1은 여전히 '터미널(쉘)'이라는 '파일'을 가리키고 있다.))
-                              // 결국, 자식 프로세스가 '표준출력'으로 뭔가를 쓰게 된다면 소켓에 쓰는 것과 마찬가지가 되는 것이다.
-    Execve(filename, emptylist, environ);
-  }
-  Wait(NULL); /* Parent waits for and reaps child */
-}
\ No newline at end of file
+  if (rio_writen(fd, buf, strlen(buf)) < 0)
+    return;
+
+  /* Real server would set all CGI vars here */
+  // built for the child: setenv would race with the other workers
+  sprintf(query, "QUERY_STRING=%s", cgiargs);
+  for (n = 0; environ[n]; n++)
+    ;
+  envp = Malloc((n + 2) * sizeof(char *));
+  for (i = n = 0; environ[i]; i++)
+    if (strncmp(environ[i], "QUERY_STRING=", 13))
+      envp[n++] = environ[i];
+  envp[n++] = query;
+  envp[n] = NULL;
+  // the child's stdout is fd, as Dup2(fd, STDOUT_FILENO) in a forked child would make it.
+  // Dup2(int oldfd, int newfd): creates a copy of the file descriptor oldfd to file descriptor newfd.
+  // If the file descriptor newfd was previously open, it is silently closed before being reused.
+  // 한국말: newfd 식별자가 oldfd 식별자가 가리키는 open file을 가리키게 한다.
+  // newfd 식별자가 원래 어떤 open file을 가리키고 있었다면,
+  // 가리키던 open file의 참조 횟수를 1 감소시킨다. (어떤 open file의 참조회수가 0이 되면 커널은 그 파일을 닫는다.)
+  // * 우리 코드 에서*
+  // 기억할 것: 자식 프로세스는 부모 프로세스의 식별자 테이블을 그대로 복사해서 자신만의 식별자 테이블을 갖는다.
+  // 그래서, 자식 프로세스의 식별자 테이블을 부모 프로세스의 식별자 테이블이 가리키는 오픈 파일들을 동일하게 가리키고 있을 것이다.
+  // 자식 프로세스의 식별자 테이블에서 식별자 1(표준출력)은 부모의 식별자 테이블에서와 마찬가지로 '터미널(쉘)'이라는 '파일'을 가리키고 있을 것이다.
+  // dup2(connfd, STDOUT_FILENO) 를 통해 자식 프로세스의 식별자 테이블에서 식별자 1은, 자신의 식별자 테이블에서 식별자 connfd가 가리키던 오픈 파일을 가리키게 된다. 부모 프로세스의 식별자 테이블에서 connfd가 가리키던 오픈 파일은 연결소켓이었으므로, 자식 프로세스의 식별자 테이블에서의 connfd가 가리키던 오픈 파일 또한 동일할 것이다.
+  // (부모 프로세스의 식별자 테이블에서 식별자 1은 여전히 '터미널(쉘)'이라는 '파일'을 가리키고 있다.))
+  // 결국, 자식 프로세스가 '표준출력'으로 뭔가를 쓰게 된다면 소켓에 쓰는 것과 마찬가지가 되는 것이다.
+  if ((pid = cgi_exec(filename, fd, STDOUT_FILENO, envp)) > 0)
+    cgi_reap(pid);   /* reaped in the background: this worker goes on to its next connection */
+  Free(envp);
+}
+
+/*
+ * cgi_exec - start filename with fd as its descriptor target, through
+ *   posix_spawn rather than Fork: glibc starts the child with
+ *   clone(CLONE_VM | CLONE_VFORK), so nothing of the server's address
+ *   space is copied however large it grows. Our other descriptors are all
+ *   close-on-exec, so the child gets only fd; its signal mask is cleared
+ *   and SIGPIPE set back to its default. Returns the child's pid, or -1.
+ */
+pid_t cgi_exec(char *filename, int fd, int target, char **envp)
+{
+  char *argv[] = {filename, NULL};
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t set;
+  pid_t pid;
+  int rc;
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, fd, target);
+  posix_spawnattr_init(&attr);
+  sigemptyset(&set);
+  posix_spawnattr_setsigmask(&attr, &set);
+  sigaddset(&set, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &set);
+  posix_spawnattr_setflags(&attr, SPAWN_FLAGS | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  rc = posix_spawn(&pid, filename, &fa, &attr, argv, envp);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  if (rc != 0) {
+    fprintf(stderr, "posix_spawn %s: %s\n", filename, strerror(rc));
+    return -1;
+  }
+  return pid;
+}
+
+/*
+ * Reaping. A spawned CGI child is handed to the reaper thread as a pidfd,
+ * which becomes readable when the child exits; the thread then collects
+ * it with waitpid. Holding the pidfd keeps the pid from being reused, and
+ * no other child (a pool worker) is ever reaped by mistake.
+ */
+void cgi_reaper_init(void)
+{
+  pthread_t tid;
+
+#ifdef SYS_pidfd_open
+  if (pipe(reap_pipe) == 0) {
+    fcntl(reap_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(reap_pipe[1], F_SETFD, FD_CLOEXEC);
+    Pthread_create(&tid, NULL, cgi_reaper, NULL);
+    return;
+  }
+#endif
+  reap_pipe[1] = -1;   // no pidfds: callers wait for their own children
+}
+
+/* Collect child pid in the background. */
+void cgi_reap(pid_t pid)
+{
+  int rec[2];
+
+#ifdef SYS_pidfd_open
+  rec[0] = pid;
+  if (reap_pipe[1] >= 0 && (rec[1] = syscall(SYS_pidfd_open, pid, 0)) >= 0) {
+    if (write(reap_pipe[1], rec, sizeof(rec)) == sizeof(rec))   // atomic: below PIPE_BUF
+      return;
+    close(rec[1]);
+  }
+#endif
+  waitpid(pid, NULL, 0);
+}
+
+void *cgi_reaper(void *vargp)
+{
+  struct pollfd *pfd = Malloc(sizeof(struct pollfd));
+  pid_t *pids = Malloc(sizeof(pid_t));
+  int n = 1, cap = 1, i, rec[2];
+
+  Pthread_detach(pthread_self());
+  pfd[0].fd = reap_pipe[0];
+  pfd[0].events = POLLIN;
+  while (1) {
+    if (poll(pfd, n, -1) < 0)
+      continue;   // EINTR
+    for (i = n - 1; i > 0; i--)
+      if (pfd[i].revents) {
+        waitpid(pids[i], NULL, WNOHANG);
+        close(pfd[i].fd);
+        pfd[i] = pfd[--n];
+        pids[i] = pids[n];
+      }
+    if (pfd[0].revents && read(reap_pipe[0], rec, sizeof(rec)) == sizeof(rec)) {
+      if (n == cap) {
+        cap *= 2;
+        pfd = Realloc(pfd, cap * sizeof(struct pollfd));
+        pids = Realloc(pids, cap * sizeof(pid_t));
+      }
+      pfd[n].fd = rec[1];
+      pfd[n].events = POLLIN;
+      pfd[n].revents = 0;
+      pids[n++] = rec[0];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Persistent CGI workers. Programs named with -W run as up to cgi_workers
+ * copies, each holding one end of a Unix socket pair. Workers are started
+ * on demand, outside any lock: a request that finds none idle starts
+ * another if the pool is not full. Requests borrow an idle worker, send it
+ * the CGI variables as frames and copy its CGI_STDOUT frames to the
+ * client. A slot whose worker cannot be (re)started is retried at most
+ * every CGI_RETRY_MS; while a pool has no live worker, its requests
+ * spawn the program the usual way.
+ */
+
+/* Register the program at uri (e.g. /cgi-bin/adder) as a worker, for -W. */
+void cgi_pool_add(char *uri)
+{
+  cgi_pool *p;
+  int i;
+
+  if (cgi_npools == CGI_PROGRAMS || uri[0] != '/' || strlen(uri) + 2 > MAXLINE) {
+    fprintf(stderr, "bad worker program \"%s\": want /path, at most %d of them\n", uri, CGI_PROGRAMS);
+    exit(1);
+  }
+  p = &cgi_pools[cgi_npools++];
+  sprintf(p->path, ".%s", uri);   // as parse_uri makes it
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  for (i = 0; i < CGI_MAX_WORKERS; i++)
+    p->dead[i] = i;   // nothing started yet
+  p->ndead = CGI_MAX_WORKERS;
+}
+
+/* The pool of filename, or NULL if it is not a worker program. */
+cgi_pool *cgi_pool_get(char *filename)
+{
+  int i;
+
+  if (cgi_workers <= 0)
+    return NULL;
+  for (i = 0; i < cgi_npools; i++)   // fixed after startup: no lock needed
+    if (!strcmp(cgi_pools[i].path, filename))
+      return &cgi_pools[i];
+  return NULL;
+}
+
+/* Start worker i of p; returns 0 once it has said CGI_READY. */
+int cgi_spawn(cgi_pool *p, int i)
+{
+  char *envp[] = {CGI_WORKER_ENV "=1", NULL};
+  struct pollfd pfd;
+  cgi_frame f;
+  int sv[2];
+  pid_t pid;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    return -1;
+  pid = cgi_exec(p->path, sv[1], CGI_WORKER_FD, envp);   // the dup2 clears close-on-exec on the copy
+  close(sv[1]);
+  if (pid < 0) {
+    close(sv[0]);
+    return -1;
+  }
+  pfd.fd = sv[0];
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, CGI_READY_MS) != 1 || cgi_recv(sv[0], &f, sizeof(f)) < 0
+      || f.type != CGI_READY) {
+    close(sv[0]);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  p->fd[i] = sv[0];
+  p->pid[i] = pid;
+  return 0;
+}
+
+/*
+ * cgi_acquire - borrow a worker of p, starting one if none is idle and
+ *   a slot is free. Returns its slot, or -1 if the pool has no live
+ *   worker.
+ */
+int cgi_acquire(cgi_pool *p)
+{
+  struct timespec now;
+  double ms;
+  int i;
+
+  pthread_mutex_lock(&p->mutex);
+  while (p->nidle == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+    if (p->nlive < cgi_workers && p->ndead > 0 && ms >= p->retry_at) {
+      i = p->dead[--p->ndead];
+      p->nlive++;
+      pthread_mutex_unlock(&p->mutex);
+      if (cgi_spawn(p, i) == 0)
+        return i;
+      cgi_lost(p, i);
+      pthread_mutex_lock(&p->mutex);
+    }
+    else if (p->nlive == 0)
+      break;   // none alive and too early to retry
+    else
+      pthread_cond_wait(&p->cond, &p->mutex);
+  }
+  i = p->nidle > 0 ? p->idle[--p->nidle] : -1;
+  pthread_mutex_unlock(&p->mutex);
+  return i;
+}
+
+/* Give worker i back to p. */
+void cgi_release(cgi_pool *p, int i)
+{
+  pthread_mutex_lock(&p->mutex);
+  p->idle[p->nidle++] = i;
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/* Slot i has no worker and could not get one: retry it later. */
+void cgi_lost(cgi_pool *p, int i)
+{
+  struct timespec now;
+
+  fprintf(stderr, "could not start a worker for %s\n", p->path);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&p->mutex);
+  p->dead[p->ndead++] = i;
+  p->nlive--;
+  p->retry_at = now.tv_sec * 1000.0 + now.tv_nsec / 1e6 + CGI_RETRY_MS;
+  pthread_cond_broadcast(&p->cond);   // waiters may have to fall back now
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/* Read exactly n bytes from a worker. */
+int cgi_recv(int fd, void *buf, size_t n)
+{
+  return rio_readn(fd, buf, n) == n ? 0 : -1;
+}
+
+/* Send a frame to a worker; a dead one must not raise SIGPIPE. */
+int cgi_send(int fd, int type, char *buf, size_t len)
+{
+  cgi_frame f;
+  char *p = (char *)&f;
+  size_t n = sizeof(f);
+  ssize_t rc;
+
+  f.type = type;
+  f.len = len;
+  while (n > 0 || len > 0) {
+    if (n == 0) {   // header done, now the payload
+      p = buf;
+      n = len;
+      len = 0;
+    }
+    if ((rc = send(fd, p, n, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      return -1;
+    p += rc;
+    n -= rc;
+  }
+  return 0;
+}
+
+/*
+ * cgi_request - send one request to worker i of p and copy its answer to
+ *   the client. Returns 0 on success, -1 if the worker failed; *started
+ *   tells whether anything reached the client.
+ */
+int cgi_request(int fd, cgi_pool *p, int i, char *cgiargs, int *started)
+{
+  char buf[CGI_FRAME_MAX + MAXLINE];
+  cgi_frame f;
+
+  sprintf(buf, "QUERY_STRING=%s", cgiargs);
+  if (cgi_send(p->fd[i], CGI_PARAM, buf, strlen(buf)) < 0
+      || cgi_send(p->fd[i], CGI_PARAM, "REQUEST_METHOD=GET", 18) < 0
+      || cgi_send(p->fd[i], CGI_STDIN, NULL, 0) < 0)
+    return -1;
+  while (1) {
+    if (cgi_recv(p->fd[i], &f, sizeof(f)) < 0 || f.len > CGI_FRAME_MAX)
+      return -1;
+    if (f.type == CGI_END)
+      return 0;
+    if (!*started) {   // same first lines as serve_dynamic
+      sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n");
+      rio_writen(fd, buf, strlen(buf));
+      *started = 1;
+    }
+    if (cgi_recv(p->fd[i], buf, f.len) < 0)
+      return -1;
+    if (f.type == CGI_STDOUT)
+      rio_writen(fd, buf, f.len);   // keep draining even if the client left
+  }
+}
+
+/*
+ * serve_pooled - run one request on a worker of p. A worker that fails is
+ *   replaced. If it had not answered yet (say it died while idle) the
+ *   request is tried once more on the replacement, then the client gets
+ *   a 502. Returns -1, with nothing sent, if p has no live worker to run
+ *   it on; the caller then spawns the program instead.
+ */
+int serve_pooled(int fd, cgi_pool *p, char *cgiargs)
+{
+  int i, started = 0, tries = 2;
+
+  if ((i = cgi_acquire(p)) < 0)
+    return -1;
+  while (cgi_request(fd, p, i, cgiargs, &started) < 0) {
+    close(p->fd[i]);
+    kill(p->pid[i], SIGKILL);
+    waitpid(p->pid[i], NULL, 0);
+    if (cgi_spawn(p, i) < 0) {   // can't replace it: the slot waits for a retry
+      cgi_lost(p, i);
+      return started ? 0 : -1;
+    }
+    if (started || --tries == 0) {
+      if (!started)
+        clienterror(fd, p->path, "502", "Bad Gateway", "Tiny's CGI worker failed");
+      break;
+    }
+  }
+  cgi_release(p, i);
+  return 0;
+}
+
+/*
+ * plugin_load - dlopen the plugin of a "-p prefix=file.so" argument. A
+ *   plugin that does not load is fatal, as a bad command line is.
+ */
+void plugin_load(char *spec)
+{
+  char *eq = strchr(spec, '=');
+  void *handle;
+  plugin *pl;
+
+  if (eq == NULL || eq == spec || nplugins == PLUGINS) {
+    fprintf(stderr, "bad plugin \"%s\": want prefix=file.so, at most %d of them\n", spec, PLUGINS);
+    exit(1);
+  }
+  *eq = '\0';
+  pl = &plugins[nplugins];
+  if ((handle = dlopen(eq + 1, RTLD_NOW | RTLD_LOCAL)) == NULL
+      || (pl->handle = (tiny_handler)dlsym(handle, TINY_HANDLER_SYM)) == NULL) {
+    fprintf(stderr, "plugin %s: %s\n", eq + 1, dlerror());
+    exit(1);
+  }
+  strcpy(pl->prefix, spec);
+  nplugins++;
+}
+
+/*
+ * The plugin with the longest prefix of uri, or NULL. The prefix must end
+ *   at a path boundary: /cgi-bin/adder takes /cgi-bin/adder?1&2 and
+ *   /cgi-bin/adder/x, not /cgi-bin/adderX.
+ */
+plugin *plugin_find(char *uri)
+{
+  plugin *best = NULL;
+  size_t len;
+  int i;
+
+  for (i = 0; i < nplugins; i++) {
+    len = strlen(plugins[i].prefix);
+    if (!strncmp(uri, plugins[i].prefix, len)
+        && (uri[len] == '\0' || uri[len] == '/' || uri[len] == '?' || plugins[i].prefix[len - 1] == '/')
+        && (best == NULL || len > strlen(best->prefix)))
+      best = &plugins[i];
+  }
+  return best;
+}
+
+/* tiny_response.write: append to the body buffer */
+void plugin_write(tiny_response *r, const void *buf, size_t len)
+{
+  plugin_body *b = r->priv;
+
+  if (b->len + len > b->cap) {
+    while (b->len + len > b->cap)
+      b->cap *= 2;
+    b->buf = Realloc(b->buf, b->cap);
+  }
+  memcpy(b->buf + b->len, buf, len);
+  b->len += len;
+}
+
+/*
+ * serve_plugin - run a plugin's handler on this thread and send what it
+ *   wrote with a Content-Length, so unlike CGI output the connection can
+ *   be kept alive. Returns keepalive.
+ */
+int serve_plugin(int fd, plugin *pl, char *uri, int keepalive)
+{
+  char query[MAXLINE], hdr[MAXLINE], *p;
+  tiny_request req;
+  tiny_response resp;
+  plugin_body body;
+  int on = 1, off = 0;
+
+  req.uri = uri;
+  req.query = (p = strchr(uri, '?')) ? p + 1 : "";
+  strcpy(query, req.query);   // split in place below
+  for (req.argc = 0, p = query; *p && req.argc < TINY_MAX_ARGS; ) {
+    req.argv[req.argc++] = p;
+    if ((p = strchr(p, '&')) == NULL)
+      break;
+    *p++ = '\0';
+  }
+  resp.status = 200;
+  strcpy(resp.content_type, "text/html");
+  resp.write = plugin_write;
+  resp.priv = &body;
+  body.cap = MAXBUF;
+  body.len = 0;
+  body.buf = Malloc(body.cap);
+
+  pl->handle(&req, &resp);
+
+  sprintf(hdr, "HTTP/1.0 %d %s\r\nServer: Tiny Web Server\r\nConnection: %s\r\n"
+          "Content-Length: %zu\r\nContent-Type: %s\r\n\r\n", resp.status,
+          reason_phrase(resp.status), keepalive ? "keep-alive" : "close",
+          body.len, resp.content_type);
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));   // head and body in one segment
+  if (rio_writen(fd, hdr, strlen(hdr)) < 0 || rio_writen(fd, body.buf, body.len) < 0)
+    keepalive = 0;   // client went away
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+  if (!bench) {
+    printf("Response headers:\n");
+    printf("%s", hdr);
+  }
+  Free(body.buf);
+  return keepalive;
+}
+/* The standard reason phrase for status, for responses tiny did not write itself. */
+char *reason_phrase(int status)
+{
+  switch (status) {
+  case 200: return "OK";
+  case 201: return "Created";
+  case 202: return "Accepted";
+  case 204: return "No Content";
+  case 301: return "Moved Permanently";
+  case 302: return "Found";
+  case 303: return "See Other";
+  case 304: return "Not Modified";
+  case 307: return "Temporary Redirect";
+  case 400: return "Bad Request";
+  case 401: return "Unauthorized";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 409: return "Conflict";
+  case 413: return "Payload Too Large";
+  case 429: return "Too Many Requests";
+  case 500: return "Internal Server Error";
+  case 501: return "Not Implemented";
+  case 502: return "Bad Gateway";
+  case 503: return "Service Unavailable";
+  case 504: return "Gateway Timeout";
+  default: return status < 300 ? "OK" : status < 400 ? "Redirect" : status < 500 ? "Client Error" : "Server Error";
+  }
+}